@@ -0,0 +1,394 @@
+/* Benchmark harness: runs each workload n times in a fresh VM and prints
+   one line of JSON per workload.
+
+   jiko-bench [-n runs] [-d dir] [workload...]
+
+   A workload is either built in (see workloads below) or a file dir/name.jk
+   defining a word `bench`, which makes one operation. Workloads run
+   through the scheduler, so they may spawn fibers. Fields:
+     ns_per_op        wall time per operation
+     steps_per_s      evaluation steps per second (0 outside the evaluator)
+     cells_allocated  cells allocated per operation
+     peak_live_cells  highest count of cells in use, garbage not yet swept
+                      included */
+
+#include "jiko.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SLICE 1024
+
+int (*jk_printf)(const char *, ...) = printf;
+
+void jiko_panic(const char *msg) {
+    fprintf(stderr, "panic: %s\n", msg);
+    exit(1);
+}
+
+typedef struct bench_result {
+    size_t steps;
+} result_t;
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Runs the input of f to completion through the scheduler, with the
+   fibers it spawns, counting steps */
+static void eval(jk_fiber_t *f, result_t *r) {
+    size_t left;
+    jk_sched_add(f);
+    do {
+        left = jk_sched_run(SLICE);
+        r->steps += SLICE - left;
+    } while (left == 0);
+    if (jk_error_raised(f) || f->state == JK_FIBER_BLOCKED) {
+        jk_fiber_print(f);
+        jiko_panic("error in workload");
+    }
+}
+
+/* Parses text into the input of f */
+static void enqueue_text(jk_fiber_t *f, const char *text) {
+    parser_t *p = parser_new();
+    jk_parse_result_t pr;
+    parser_set_text(p, text);
+    while ((pr = parser_parse(p)).type == JK_PARSE_OK)
+        jk_fiber_enqueue(f, pr.result.j);
+    if (pr.type != JK_PARSE_EOF_OK) {
+        fprintf(stderr, "%s\n", pr.result.error_msg);
+        jiko_panic("parse error in workload");
+    }
+    jk_parse_result_free(pr);
+    parser_free(p);
+}
+
+/* Generated inputs **********************************************************/
+
+static char *generate_program(size_t size) {
+    static const char *pieces[] = {
+        "dup ", "123 ", "[a b [c d]] ", "\"hello\\n world\" ",
+        "swap\n", "   fib   ", "[1 [2 [3 [4]]]] ", "ifte\t",
+    };
+    char *text = (char *)malloc(size + 64);
+    size_t len = 0;
+    if (!text)
+        jiko_panic("malloc failed");
+    srand(1);
+    while (len < size) {
+        const char *p = pieces[rand() % (sizeof(pieces) / sizeof(*pieces))];
+        size_t n = strlen(p);
+        memcpy(text + len, p, n);
+        len += n;
+    }
+    text[len] = 0;
+    return text;
+}
+
+/* [[[ ... [1] call ... ] call ] call ] call */
+static char *generate_nest(size_t depth) {
+    char *text = (char *)malloc(depth * 8 + 16), *p = text;
+    if (!text)
+        jiko_panic("malloc failed");
+    for (size_t i = 0; i < depth; i++)
+        *p++ = '[';
+    p += sprintf(p, " 1 ");
+    for (size_t i = 0; i < depth; i++)
+        p += sprintf(p, "] call ");
+    strcpy(p, "drop");
+    return text;
+}
+
+/* Workloads *****************************************************************/
+
+typedef struct workload {
+    const char *name;
+    void *(*setup)(jk_fiber_t *f); /* returns the state of op */
+    void (*op)(jk_fiber_t *f, void *state, result_t *r);
+    void (*teardown)(void *state);
+} workload_t;
+
+static void op_eval_text(jk_fiber_t *f, void *text, result_t *r) {
+    enqueue_text(f, (const char *)text);
+    eval(f, r);
+}
+
+static void *setup_nest(jk_fiber_t *f) {
+    (void)f;
+    return generate_nest(1000);
+}
+
+static void *setup_program(jk_fiber_t *f) {
+    (void)f;
+    return generate_program(1 << 20);
+}
+
+static void *setup_lex(jk_fiber_t *f) {
+    (void)f;
+    return generate_program(16 << 20);
+}
+
+static void op_parse(jk_fiber_t *f, void *text, result_t *r) {
+    parser_t *p = parser_new();
+    (void)f;
+    (void)r;
+    parser_set_text(p, (const char *)text);
+    while (parser_parse(p).type == JK_PARSE_OK)
+        ;
+    parser_free(p);
+    jk_gc_maybe();
+}
+
+static void op_lex(jk_fiber_t *f, void *text, result_t *r) {
+    lexer_t *lex = lexer_new();
+    (void)f;
+    (void)r;
+    lexer_set_text(lex, (const char *)text);
+    while (lexer_next(lex).type != TOK_EOF)
+        ;
+    lexer_free(lex);
+}
+
+#define LIST_LENGTH 100000
+
+static jk_object_t make_list(size_t n) {
+    jk_object_t head = JK_NIL, tail = JK_NIL;
+    for (size_t i = 0; i < n; i++) {
+        jk_object_t cell = jk_make_pair(jk_make_int((JK_INT_CTYPE)i), JK_NIL);
+        if (head == JK_NIL)
+            head = cell;
+        else
+            CDR(tail) = cell;
+        tail = cell;
+    }
+    return head;
+}
+
+static void op_list(jk_fiber_t *f, void *state, result_t *r) {
+    (void)f;
+    (void)state;
+    (void)r;
+    make_list(LIST_LENGTH);
+    jk_gc_maybe();
+}
+
+/* Serializes a list kept on the stack of f, out of the collector's way,
+   without writing it anywhere */
+static void *setup_print(jk_fiber_t *f) {
+    jk_push(f, make_list(LIST_LENGTH));
+    return NULL;
+}
+
+static void op_print(jk_fiber_t *f, void *state, result_t *r) {
+    (void)state;
+    (void)r;
+    free(jk_to_string(f->stack.items[0], 0));
+}
+
+#define VECTOR_LENGTH (1 << 20)
+
+/* The vector is kept at the bottom of the stack of f, each builtin working
+   on a copy of it pushed by dup */
+static void *setup_vector(jk_fiber_t *f) {
+    jk_vector_t *v = jk_vector_new(VECTOR_LENGTH);
+    for (size_t i = 0; i < VECTOR_LENGTH; i++)
+        v->items[i] = (int64_t)(i * 7 % 1000);
+    jk_push(f, jk_make_vector(v));
+    return strdup("dup dup v+ drop dup dup v* drop dup 3 vscale drop "
+                  "dup vsum drop dup vmax drop dup dup vdot drop");
+}
+
+/* Ping-pong through two shared channels with a second VM, which runs on a
+   thread of its own and echoes what it receives until it gets 0 */
+#define VOLLEYS "10000"
+
+typedef struct shared_state {
+    jk_chan_t *ping, *pong;
+    pthread_t echo;
+} shared_state_t;
+
+/* Boxes the channels of s in the current VM as the words ping and pong */
+static void define_channels(jk_fiber_t *f, shared_state_t *s) {
+    result_t r = {0};
+    jk_push(f, jk_make_chan(s->ping));
+    jk_push(f, jk_make_chan(s->pong));
+    enqueue_text(f, "' pong def ' ping def");
+    eval(f, &r);
+}
+
+static void *shared_echo(void *state) {
+    result_t r = {0};
+    jiko_init();
+    jk_fiber_t *f = jk_fiber_new();
+    define_channels(f, (shared_state_t *)state);
+    enqueue_text(f, "[ ping recv dup 0 = [ drop ] [ pong send echo ] ifte ] "
+                    "' echo defn echo");
+    eval(f, &r);
+    jk_fiber_free(f);
+    jiko_cleanup();
+    return NULL;
+}
+
+static void *setup_shared(jk_fiber_t *f) {
+    result_t r = {0};
+    shared_state_t *s = (shared_state_t *)malloc(sizeof(shared_state_t));
+    if (!s)
+        jiko_panic("malloc failed");
+    s->ping = jk_chan_new(1, JK_CHAN_SHARED);
+    s->pong = jk_chan_new(1, JK_CHAN_SHARED);
+    define_channels(f, s);
+    enqueue_text(f, "[ dup 0 = [ drop ] [ 7 ping send pong recv drop 1 - "
+                    "volley ] ifte ] ' volley defn");
+    eval(f, &r);
+    if (pthread_create(&s->echo, NULL, shared_echo, s))
+        jiko_panic("pthread_create failed");
+    return s;
+}
+
+static void op_shared(jk_fiber_t *f, void *state, result_t *r) {
+    (void)state;
+    enqueue_text(f, VOLLEYS " volley");
+    eval(f, r);
+}
+
+static void teardown_shared(void *state) {
+    shared_state_t *s = (shared_state_t *)state;
+    while (jk_chan_try_send(s->ping, jk_make_int(0)) != 1)
+        sched_yield();
+    pthread_join(s->echo, NULL);
+    jk_chan_release(s->ping);
+    jk_chan_release(s->pong);
+    free(s);
+}
+
+static const workload_t workloads[] = {
+    {"nest", setup_nest, op_eval_text, free},
+    {"list", NULL, op_list, NULL},
+    {"parse", setup_program, op_parse, free},
+    {"lex", setup_lex, op_lex, free},
+    {"vector", setup_vector, op_eval_text, free},
+    {"print", setup_print, op_print, NULL},
+    {"shared", setup_shared, op_shared, teardown_shared},
+};
+
+#define WORKLOADS_COUNT (sizeof(workloads) / sizeof(*workloads))
+
+static const char *default_names[] = {"fac",    "bigfac", "bigsq",    "fib",
+                                      "loop",   "deep",   "nest",     "list",
+                                      "parse",  "lex",    "vector",   "concat",
+                                      "print",  "yield",  "spawn",    "pingpong",
+                                      "shared"};
+
+/* Harness *******************************************************************/
+
+static char *read_file(const char *path) {
+    FILE *in = fopen(path, "rb");
+    char *text;
+    long len;
+    if (!in)
+        return NULL;
+    fseek(in, 0, SEEK_END);
+    len = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    text = (char *)malloc(len + 1);
+    if (!text || fread(text, 1, len, in) != (size_t)len)
+        jiko_panic("cannot read workload");
+    text[len] = 0;
+    fclose(in);
+    return text;
+}
+
+static void op_bench_word(jk_fiber_t *f, void *state, result_t *r) {
+    (void)state;
+    jk_fiber_enqueue(f, jk_make_word_from_string("bench"));
+    eval(f, r);
+}
+
+static int run(const char *name, const char *dir, size_t runs) {
+    const workload_t *w = NULL;
+    workload_t file = {NULL, NULL, op_bench_word, NULL};
+    char *text = NULL;
+    void *state = NULL;
+    result_t r = {0};
+
+    for (size_t i = 0; i < WORKLOADS_COUNT; i++)
+        if (strcmp(workloads[i].name, name) == 0)
+            w = &workloads[i];
+    if (!w) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s.jk", dir, name);
+        if (!(text = read_file(path))) {
+            fprintf(stderr, "jiko-bench: unknown workload %s\n", name);
+            return 0;
+        }
+        file.name = name;
+        w = &file;
+    }
+
+    jiko_init();
+    jk_fiber_t *f = jk_fiber_new();
+    if (text) {
+        enqueue_text(f, text);
+        eval(f, &r);
+        free(text);
+    }
+    if (w->setup)
+        state = w->setup(f);
+    w->op(f, state, &r); /* warm up */
+    jk_gc_collect();
+
+    size_t allocated = jk_vm->heap.allocated;
+    r.steps = 0;
+    jk_vm->heap.peak = jk_vm->heap.live;
+    double start = now();
+    for (size_t i = 0; i < runs; i++)
+        w->op(f, state, &r);
+    double elapsed = now() - start;
+    allocated = jk_vm->heap.allocated - allocated;
+
+    printf("{\"bench\": \"%s\", \"runs\": %zu, \"ns_per_op\": %.0f, "
+           "\"steps_per_s\": %.0f, \"cells_allocated\": %zu, "
+           "\"peak_live_cells\": %zu}\n",
+           name, runs, elapsed * 1e9 / runs, r.steps / elapsed,
+           allocated / runs, jk_vm->heap.peak);
+    fflush(stdout);
+    if (w->teardown)
+        w->teardown(state);
+    jk_fiber_free(f);
+    jiko_cleanup();
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    size_t runs = 10;
+    const char *dir = "bench";
+    int arg = 1, ok = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+        if (strcmp(argv[arg], "-n") == 0)
+            runs = (size_t)atol(argv[arg + 1]);
+        else if (strcmp(argv[arg], "-d") == 0)
+            dir = argv[arg + 1];
+        else
+            break;
+    }
+    if (arg < argc && argv[arg][0] == '-') {
+        fprintf(stderr, "usage: jiko-bench [-n runs] [-d dir] [workload...]\n");
+        return 2;
+    }
+    if (runs == 0)
+        runs = 1;
+    if (arg == argc)
+        for (size_t i = 0; i < sizeof(default_names) / sizeof(*default_names);
+             i++)
+            ok &= run(default_names[i], dir, runs);
+    else
+        for (; arg < argc; arg++)
+            ok &= run(argv[arg], dir, runs);
+    return ok ? 0 : 1;
+}
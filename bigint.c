@@ -0,0 +1,487 @@
+#include "bigint.h"
+#include "heap.h"
+#include "misc.h"
+#include "vm.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Magnitudes are arrays of 32 bit limbs, least significant first, and the
+   arithmetic on them works limb by limb in 64 bit. Multiplication is the
+   schoolbook one up to KARATSUBA_THRESHOLD limbs, Karatsuba above. */
+
+#define KARATSUBA_THRESHOLD 32
+#define LIMB_BITS 32
+#define LIMB_BASE ((uint64_t)1 << LIMB_BITS)
+
+#if !defined(__GNUC__)
+int jk_add_overflow(JK_INT_CTYPE a, JK_INT_CTYPE b, JK_INT_CTYPE *r) {
+    if ((b > 0 && a > JK_INT_CTYPE_MAX - b) ||
+        (b < 0 && a < JK_INT_CTYPE_MIN - b))
+        return 1;
+    *r = a + b;
+    return 0;
+}
+
+int jk_sub_overflow(JK_INT_CTYPE a, JK_INT_CTYPE b, JK_INT_CTYPE *r) {
+    if ((b < 0 && a > JK_INT_CTYPE_MAX + b) ||
+        (b > 0 && a < JK_INT_CTYPE_MIN + b))
+        return 1;
+    *r = a - b;
+    return 0;
+}
+
+int jk_mul_overflow(JK_INT_CTYPE a, JK_INT_CTYPE b, JK_INT_CTYPE *r) {
+    if (a && b &&
+        ((a == -1 && b == JK_INT_CTYPE_MIN) ||
+         (b == -1 && a == JK_INT_CTYPE_MIN) ||
+         (a != -1 && b != -1 &&
+          (a * b) / b != a))) /* only reached when a * b cannot trap */
+        return 1;
+    *r = a * b;
+    return 0;
+}
+#endif
+
+/* Magnitudes *****************************************************************/
+
+static size_t trim(const jk_limb_t *a, size_t n) {
+    while (n && !a[n - 1])
+        n--;
+    return n;
+}
+
+static int mag_compare(const jk_limb_t *a, size_t an, const jk_limb_t *b,
+                       size_t bn) {
+    if (an != bn)
+        return an < bn ? -1 : 1;
+    while (an--)
+        if (a[an] != b[an])
+            return a[an] < b[an] ? -1 : 1;
+    return 0;
+}
+
+/* r = a + b with an >= bn, r has an + 1 limbs */
+static void mag_add(jk_limb_t *r, const jk_limb_t *a, size_t an,
+                    const jk_limb_t *b, size_t bn) {
+    uint64_t carry = 0;
+    size_t i;
+    for (i = 0; i < bn; i++) {
+        carry += (uint64_t)a[i] + b[i];
+        r[i] = (jk_limb_t)carry;
+        carry >>= LIMB_BITS;
+    }
+    for (; i < an; i++) {
+        carry += a[i];
+        r[i] = (jk_limb_t)carry;
+        carry >>= LIMB_BITS;
+    }
+    r[an] = (jk_limb_t)carry;
+}
+
+/* r = a - b with a >= b, r has an limbs */
+static void mag_sub(jk_limb_t *r, const jk_limb_t *a, size_t an,
+                    const jk_limb_t *b, size_t bn) {
+    int64_t borrow = 0;
+    size_t i;
+    for (i = 0; i < bn; i++) {
+        int64_t d = (int64_t)a[i] - b[i] - borrow;
+        borrow = d < 0;
+        r[i] = (jk_limb_t)d;
+    }
+    for (; i < an; i++) {
+        int64_t d = (int64_t)a[i] - borrow;
+        borrow = d < 0;
+        r[i] = (jk_limb_t)d;
+    }
+    assert(!borrow);
+}
+
+/* r += a, where the sum fits in the rn limbs of r */
+static void mag_add_to(jk_limb_t *r, size_t rn, const jk_limb_t *a,
+                       size_t an) {
+    uint64_t carry = 0;
+    size_t i;
+    for (i = 0; i < an; i++) {
+        carry += (uint64_t)r[i] + a[i];
+        r[i] = (jk_limb_t)carry;
+        carry >>= LIMB_BITS;
+    }
+    for (; carry && i < rn; i++) {
+        carry += r[i];
+        r[i] = (jk_limb_t)carry;
+        carry >>= LIMB_BITS;
+    }
+    assert(!carry);
+}
+
+/* r -= a, where a <= r */
+static void mag_sub_from(jk_limb_t *r, size_t rn, const jk_limb_t *a,
+                         size_t an) {
+    mag_sub(r, r, rn, a, an);
+}
+
+static void mul_school(jk_limb_t *r, const jk_limb_t *a, size_t an,
+                       const jk_limb_t *b, size_t bn) {
+    memset(r, 0, sizeof(jk_limb_t) * (an + bn));
+    for (size_t i = 0; i < bn; i++) {
+        uint64_t carry = 0, bi = b[i];
+        if (!bi)
+            continue;
+        for (size_t k = 0; k < an; k++) {
+            carry += a[k] * bi + r[i + k];
+            r[i + k] = (jk_limb_t)carry;
+            carry >>= LIMB_BITS;
+        }
+        r[i + an] = (jk_limb_t)carry;
+    }
+}
+
+static jk_limb_t *limbs_alloc(size_t n) {
+    jk_limb_t *res = (jk_limb_t *)malloc(sizeof(jk_limb_t) * (n ? n : 1));
+    if (!res)
+        jiko_panic("limbs_alloc: malloc failed");
+    return res;
+}
+
+static void mul_karatsuba(jk_limb_t *r, const jk_limb_t *a, size_t an,
+                          const jk_limb_t *b, size_t bn);
+
+/* r = a * b, r has an + bn limbs */
+static void mag_mul(jk_limb_t *r, const jk_limb_t *a, size_t an,
+                    const jk_limb_t *b, size_t bn) {
+    if (an < bn) {
+        const jk_limb_t *t = a;
+        size_t tn = an;
+        a = b, an = bn;
+        b = t, bn = tn;
+    }
+    if (bn == 0)
+        memset(r, 0, sizeof(jk_limb_t) * an);
+    else if (bn < KARATSUBA_THRESHOLD)
+        mul_school(r, a, an, b, bn);
+    else
+        mul_karatsuba(r, a, an, b, bn);
+}
+
+/* With an >= bn >= KARATSUBA_THRESHOLD. Operands of very different lengths
+   are multiplied piece by piece, balanced ones by splitting them in a
+   high and a low half at m limbs:
+     a * b = z2 B^2m + (z1 - z2 - z0) B^m + z0
+   with z0 = a0 b0, z2 = a1 b1 and z1 = (a0 + a1)(b0 + b1) */
+static void mul_karatsuba(jk_limb_t *r, const jk_limb_t *a, size_t an,
+                          const jk_limb_t *b, size_t bn) {
+    size_t rn = an + bn;
+    if (2 * bn <= an) {
+        jk_limb_t *t = limbs_alloc(2 * bn);
+        memset(r, 0, sizeof(jk_limb_t) * rn);
+        for (size_t i = 0; i < an; i += bn) {
+            size_t n = an - i < bn ? an - i : bn;
+            mag_mul(t, a + i, n, b, bn);
+            mag_add_to(r + i, rn - i, t, n + bn);
+        }
+        free(t);
+        return;
+    }
+
+    size_t m = an / 2; /* bn > m */
+    size_t a1n = an - m, b1n = bn - m;
+    size_t sn = a1n + 1, tn = (b1n > m ? b1n : m) + 1;
+    jk_limb_t *s = limbs_alloc(sn + tn), *t = s + sn;
+    jk_limb_t *z1 = limbs_alloc(sn + tn);
+
+    mag_mul(r, a, m, b, m);                     /* z0 */
+    mag_mul(r + 2 * m, a + m, a1n, b + m, b1n); /* z2 */
+    mag_add(s, a + m, a1n, a, m);
+    if (b1n >= m)
+        mag_add(t, b + m, b1n, b, m);
+    else
+        mag_add(t, b, m, b + m, b1n);
+    sn = trim(s, sn);
+    tn = trim(t, tn);
+    mag_mul(z1, s, sn, t, tn);
+
+    size_t zn = trim(z1, sn + tn);
+    mag_sub_from(z1, zn, r, trim(r, 2 * m));
+    mag_sub_from(z1, zn, r + 2 * m, trim(r + 2 * m, rn - 2 * m));
+    mag_add_to(r + m, rn - m, z1, trim(z1, zn));
+    free(s);
+    free(z1);
+}
+
+/* q = a / b and r = a % b, with an >= bn > 0 and a normalized b. q has
+   an - bn + 1 limbs, r has bn limbs. Algorithm D of Knuth, as written in
+   Hacker's Delight. */
+static void mag_divmod(const jk_limb_t *a, size_t an, const jk_limb_t *b,
+                       size_t bn, jk_limb_t *q, jk_limb_t *r) {
+    if (bn == 1) {
+        uint64_t rem = 0;
+        for (size_t i = an; i-- > 0;) {
+            uint64_t cur = (rem << LIMB_BITS) | a[i];
+            q[i] = (jk_limb_t)(cur / b[0]);
+            rem = cur % b[0];
+        }
+        r[0] = (jk_limb_t)rem;
+        return;
+    }
+
+    unsigned s = 0;
+    while (!(b[bn - 1] << s & 0x80000000u))
+        s++;
+    jk_limb_t *vn = limbs_alloc(bn), *un = limbs_alloc(an + 1);
+    for (size_t i = bn - 1; i > 0; i--)
+        vn[i] = s ? (b[i] << s) | (b[i - 1] >> (LIMB_BITS - s)) : b[i];
+    vn[0] = b[0] << s;
+    un[an] = s ? a[an - 1] >> (LIMB_BITS - s) : 0;
+    for (size_t i = an - 1; i > 0; i--)
+        un[i] = s ? (a[i] << s) | (a[i - 1] >> (LIMB_BITS - s)) : a[i];
+    un[0] = a[0] << s;
+
+    for (size_t j = an - bn + 1; j-- > 0;) {
+        uint64_t num = ((uint64_t)un[j + bn] << LIMB_BITS) | un[j + bn - 1];
+        uint64_t qhat = num / vn[bn - 1], rhat = num % vn[bn - 1];
+        while (qhat >= LIMB_BASE ||
+               qhat * vn[bn - 2] > ((rhat << LIMB_BITS) | un[j + bn - 2])) {
+            qhat--;
+            rhat += vn[bn - 1];
+            if (rhat >= LIMB_BASE)
+                break;
+        }
+        int64_t k = 0, t;
+        for (size_t i = 0; i < bn; i++) {
+            uint64_t p = qhat * vn[i];
+            t = (int64_t)un[i + j] - k - (int64_t)(p & 0xffffffffu);
+            un[i + j] = (jk_limb_t)t;
+            k = (int64_t)(p >> LIMB_BITS) - (t >> LIMB_BITS);
+        }
+        t = (int64_t)un[j + bn] - k;
+        un[j + bn] = (jk_limb_t)t;
+        q[j] = (jk_limb_t)qhat;
+        if (t < 0) { /* qhat was one too many: add b back */
+            uint64_t carry = 0;
+            q[j]--;
+            for (size_t i = 0; i < bn; i++) {
+                carry += (uint64_t)un[i + j] + vn[i];
+                un[i + j] = (jk_limb_t)carry;
+                carry >>= LIMB_BITS;
+            }
+            un[j + bn] += (jk_limb_t)carry;
+        }
+    }
+    for (size_t i = 0; i < bn; i++)
+        r[i] = s ? (un[i] >> s) | (un[i + 1] << (LIMB_BITS - s)) : un[i];
+    free(vn);
+    free(un);
+}
+
+/* Big integers ***************************************************************/
+
+static jk_bigint_t *bigint_alloc(size_t len) {
+    jk_bigint_t *res =
+        (jk_bigint_t *)malloc(sizeof(jk_bigint_t) + sizeof(jk_limb_t) * len);
+    if (!res)
+        jiko_panic("bigint_alloc: malloc failed");
+    res->negative = 0;
+    res->len = len;
+    return res;
+}
+
+static jk_bigint_t *normalize(jk_bigint_t *a) {
+    a->len = trim(a->limbs, a->len);
+    if (!a->len)
+        a->negative = 0;
+    return a;
+}
+
+jk_bigint_t *jk_bigint_from_int(JK_INT_CTYPE i) {
+    unsigned long u = i < 0 ? 0ul - (unsigned long)i : (unsigned long)i;
+    jk_bigint_t *res = bigint_alloc(sizeof(u) / sizeof(jk_limb_t));
+    res->negative = i < 0;
+    for (size_t k = 0; k < res->len; k++) {
+        res->limbs[k] = (jk_limb_t)u;
+        u = sizeof(u) > sizeof(jk_limb_t) ? u >> (LIMB_BITS - 1) >> 1 : 0;
+    }
+    return normalize(res);
+}
+
+jk_bigint_t *jk_bigint_from_chars(const char *str, size_t len) {
+    int negative = len && *str == '-';
+    str += negative;
+    len -= negative;
+    if (!len)
+        return NULL;
+    jk_bigint_t *res = bigint_alloc(len / 9 + 2);
+    res->len = 0;
+    while (len) {
+        size_t n = len % 9 ? len % 9 : 9; /* digits of this chunk */
+        uint64_t carry = 0, scale = 1;
+        for (size_t i = 0; i < n; i++) {
+            if (str[i] < '0' || str[i] > '9') {
+                free(res);
+                return NULL;
+            }
+            carry = carry * 10 + (uint64_t)(str[i] - '0');
+            scale *= 10;
+        }
+        for (size_t i = 0; i < res->len; i++) {
+            carry += res->limbs[i] * scale;
+            res->limbs[i] = (jk_limb_t)carry;
+            carry >>= LIMB_BITS;
+        }
+        if (carry)
+            res->limbs[res->len++] = (jk_limb_t)carry;
+        str += n;
+        len -= n;
+    }
+    res->negative = negative;
+    return normalize(res);
+}
+
+jk_bigint_t *jk_bigint_copy(const jk_bigint_t *a) {
+    jk_bigint_t *res = bigint_alloc(a->len);
+    memcpy(res, a, jk_bigint_size(a));
+    return res;
+}
+
+size_t jk_bigint_size(const jk_bigint_t *a) {
+    return sizeof(jk_bigint_t) + sizeof(jk_limb_t) * a->len;
+}
+
+int jk_bigint_to_int(const jk_bigint_t *a, JK_INT_CTYPE *res) {
+    unsigned long u = 0;
+    if (a->len > sizeof(u) / sizeof(jk_limb_t))
+        return 0;
+    for (size_t k = a->len; k-- > 0;)
+        u = (sizeof(u) > sizeof(jk_limb_t) ? u << (LIMB_BITS - 1) << 1 : 0) |
+            a->limbs[k];
+    if (!a->negative && u <= (unsigned long)JK_INT_CTYPE_MAX)
+        *res = (JK_INT_CTYPE)u;
+    else if (a->negative && u - 1 <= (unsigned long)JK_INT_CTYPE_MAX)
+        *res = -(JK_INT_CTYPE)(u - 1) - 1;
+    else
+        return 0;
+    return 1;
+}
+
+/* Digits are taken out nine at a time, by dividing by 10^9 in place */
+char *jk_bigint_to_string(const jk_bigint_t *a) {
+    size_t n = a->len, digits = 0;
+    jk_limb_t *t = limbs_alloc(n);
+    uint32_t *chunks = (uint32_t *)malloc(sizeof(uint32_t) * (n * 10 / 9 + 2));
+    char *res = (char *)malloc(n * 10 + 3), *p = res;
+    if (!chunks || !res)
+        jiko_panic("jk_bigint_to_string: malloc failed");
+    memcpy(t, a->limbs, sizeof(jk_limb_t) * n);
+    do {
+        uint64_t rem = 0;
+        for (size_t i = n; i-- > 0;) {
+            uint64_t cur = (rem << LIMB_BITS) | t[i];
+            t[i] = (jk_limb_t)(cur / 1000000000u);
+            rem = cur % 1000000000u;
+        }
+        chunks[digits++] = (uint32_t)rem;
+        n = trim(t, n);
+    } while (n);
+    if (a->negative)
+        *p++ = '-';
+    p += sprintf(p, "%u", chunks[--digits]);
+    while (digits)
+        p += sprintf(p, "%09u", chunks[--digits]);
+    free(t);
+    free(chunks);
+    return res;
+}
+
+int jk_bigint_compare(const jk_bigint_t *a, const jk_bigint_t *b) {
+    if (a->negative != b->negative)
+        return a->negative ? -1 : 1;
+    int c = mag_compare(a->limbs, a->len, b->limbs, b->len);
+    return a->negative ? -c : c;
+}
+
+/* a + b, with the sign of b flipped by negate_b */
+static jk_bigint_t *add_signed(const jk_bigint_t *a, const jk_bigint_t *b,
+                               int negate_b) {
+    const jk_bigint_t *x = a, *y = b;
+    int x_negative = a->negative, y_negative = b->negative ^ negate_b;
+    if (mag_compare(a->limbs, a->len, b->limbs, b->len) < 0) {
+        x = b, y = a;
+        x_negative = y_negative, y_negative = a->negative;
+    }
+    /* |x| >= |y|: the result has the sign of x */
+    jk_bigint_t *res = bigint_alloc(x->len + 1);
+    if (x_negative == y_negative) {
+        mag_add(res->limbs, x->limbs, x->len, y->limbs, y->len);
+    } else {
+        mag_sub(res->limbs, x->limbs, x->len, y->limbs, y->len);
+        res->limbs[x->len] = 0;
+    }
+    res->negative = x_negative;
+    return normalize(res);
+}
+
+jk_bigint_t *jk_bigint_add(const jk_bigint_t *a, const jk_bigint_t *b) {
+    return add_signed(a, b, 0);
+}
+
+jk_bigint_t *jk_bigint_sub(const jk_bigint_t *a, const jk_bigint_t *b) {
+    return add_signed(a, b, 1);
+}
+
+jk_bigint_t *jk_bigint_mul(const jk_bigint_t *a, const jk_bigint_t *b) {
+    jk_bigint_t *res = bigint_alloc(a->len + b->len);
+    mag_mul(res->limbs, a->limbs, a->len, b->limbs, b->len);
+    res->negative = a->negative != b->negative;
+    return normalize(res);
+}
+
+void jk_bigint_divmod(const jk_bigint_t *a, const jk_bigint_t *b,
+                      jk_bigint_t **q, jk_bigint_t **r) {
+    assert(b->len);
+    if (mag_compare(a->limbs, a->len, b->limbs, b->len) < 0) {
+        if (q)
+            *q = bigint_alloc(0);
+        if (r)
+            *r = jk_bigint_copy(a);
+        return;
+    }
+    jk_bigint_t *qt = bigint_alloc(a->len - b->len + 1);
+    jk_bigint_t *rt = bigint_alloc(b->len);
+    mag_divmod(a->limbs, a->len, b->limbs, b->len, qt->limbs, rt->limbs);
+    qt->negative = a->negative != b->negative;
+    rt->negative = a->negative;
+    if (q)
+        *q = normalize(qt);
+    else
+        free(qt);
+    if (r)
+        *r = normalize(rt);
+    else
+        free(rt);
+}
+
+/* Objects ********************************************************************/
+
+jk_object_t jk_make_bigint(jk_bigint_t *b) {
+    JK_INT_CTYPE i;
+    if (jk_bigint_to_int(b, &i)) {
+        free(b);
+        return jk_make_int(i);
+    }
+    jk_object_t res = jk_object_alloc();
+    jk_set_type(res, JK_BIGINT);
+    AS_BIGINT(res) = b;
+    return res;
+}
+
+jk_object_t jk_make_int_from_chars(const char *str, size_t len) {
+    JK_INT_CTYPE i = 0;
+    if (len < 3 * sizeof(JK_INT_CTYPE) - 5) { /* up to 18 digits in 64 bit */
+        for (size_t k = 0; k < len; k++)
+            i = i * 10 + (str[k] - '0');
+        return jk_make_int(i);
+    }
+    jk_bigint_t *b = jk_bigint_from_chars(str, len);
+    assert(b);
+    return jk_make_bigint(b);
+}
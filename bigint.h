@@ -0,0 +1,65 @@
+#ifndef BIGINT_H
+#define BIGINT_H
+
+#include "types.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Arbitrary precision integers. An integer is a JK_INT while it fits in
+   JK_INT_CTYPE: arithmetic on those checks for overflow and only then
+   goes through a jk_bigint_t, held by a JK_BIGINT cell. Results come back
+   through jk_make_bigint, which demotes them to JK_INT when they fit, so
+   that an integer has a single representation and two integers of
+   different types are never equal. */
+
+typedef uint32_t jk_limb_t;
+
+/* Sign and magnitude, never modified once made */
+typedef struct jk_bigint {
+    int negative;
+    size_t len;         /* limbs used, 0 for zero, the last one not 0 */
+    jk_limb_t limbs[];  /* least significant first */
+} jk_bigint_t;
+
+/* Overflow checked arithmetic on JK_INT_CTYPE: store the result in *r and
+   evaluate to nonzero if it does not fit */
+#if defined(__GNUC__)
+#define JK_ADD_OVERFLOW(a, b, r) __builtin_add_overflow((a), (b), (r))
+#define JK_SUB_OVERFLOW(a, b, r) __builtin_sub_overflow((a), (b), (r))
+#define JK_MUL_OVERFLOW(a, b, r) __builtin_mul_overflow((a), (b), (r))
+#else
+int jk_add_overflow(JK_INT_CTYPE a, JK_INT_CTYPE b, JK_INT_CTYPE *r);
+int jk_sub_overflow(JK_INT_CTYPE a, JK_INT_CTYPE b, JK_INT_CTYPE *r);
+int jk_mul_overflow(JK_INT_CTYPE a, JK_INT_CTYPE b, JK_INT_CTYPE *r);
+#define JK_ADD_OVERFLOW(a, b, r) jk_add_overflow((a), (b), (r))
+#define JK_SUB_OVERFLOW(a, b, r) jk_sub_overflow((a), (b), (r))
+#define JK_MUL_OVERFLOW(a, b, r) jk_mul_overflow((a), (b), (r))
+#endif
+
+/* Results are allocated with malloc and released with free */
+jk_bigint_t *jk_bigint_from_int(JK_INT_CTYPE i);
+/* Decimal digits, after an optional '-'. Returns NULL on anything else. */
+jk_bigint_t *jk_bigint_from_chars(const char *str, size_t len);
+jk_bigint_t *jk_bigint_copy(const jk_bigint_t *a);
+/* Size of a in bytes, header included */
+size_t jk_bigint_size(const jk_bigint_t *a);
+/* Returns 0 if a does not fit in JK_INT_CTYPE */
+int jk_bigint_to_int(const jk_bigint_t *a, JK_INT_CTYPE *res);
+char *jk_bigint_to_string(const jk_bigint_t *a);
+int jk_bigint_compare(const jk_bigint_t *a, const jk_bigint_t *b);
+
+jk_bigint_t *jk_bigint_add(const jk_bigint_t *a, const jk_bigint_t *b);
+jk_bigint_t *jk_bigint_sub(const jk_bigint_t *a, const jk_bigint_t *b);
+/* Karatsuba multiplication once both operands are long enough */
+jk_bigint_t *jk_bigint_mul(const jk_bigint_t *a, const jk_bigint_t *b);
+/* Division truncated toward zero, like the one of JK_INT_CTYPE. b is not
+   zero; q or r may be NULL. */
+void jk_bigint_divmod(const jk_bigint_t *a, const jk_bigint_t *b,
+                      jk_bigint_t **q, jk_bigint_t **r);
+
+/* Takes b and returns it as an integer object, JK_INT if it fits */
+jk_object_t jk_make_bigint(jk_bigint_t *b);
+/* Integer object of the decimal literal str */
+jk_object_t jk_make_int_from_chars(const char *str, size_t len);
+
+#endif
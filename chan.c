@@ -0,0 +1,550 @@
+#include "chan.h"
+#include "bigint.h"
+#include "str.h"
+#include "vector.h"
+#include "heap.h"
+#include "misc.h"
+#include "types.h"
+#include "vm.h"
+#include "word_table.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The ring is the bounded queue of Dmitry Vyukov: every slot carries a
+   sequence number telling whose turn it is, so that threads can send and
+   receive concurrently without a lock (multiple producers and consumers,
+   which covers MPSC and SPSC). Positions only grow. The slot of position p
+   is free for the sender when its sequence is p, and holds a value for the
+   receiver when its sequence is p + 1. The ring has a power-of-two number
+   of slots, at least the capacity: a sender also finds the channel full
+   once the position it would take is capacity ahead of the receivers. */
+
+#if defined(__GNUC__)
+#define CHAN_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define CHAN_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define CHAN_CAS(p, e, v)                                                      \
+    __atomic_compare_exchange_n((p), (e), (v), 1, __ATOMIC_RELAXED,            \
+                                __ATOMIC_RELAXED)
+#define CHAN_ADD(p, v) __atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL)
+#else /* not thread safe */
+#define CHAN_LOAD(p) (*(p))
+#define CHAN_STORE(p, v) (*(p) = (v))
+#define CHAN_CAS(p, e, v) (*(p) == *(e) ? (*(p) = (v), 1) : (*(e) = *(p), 0))
+#define CHAN_ADD(p, v) (*(p) += (v))
+#endif
+
+#define CHAN_CACHE_LINE 64
+
+typedef struct chan_slot {
+    size_t seq;
+    jk_object_t value;   /* the value, or JK_UNDEFINED when it is in data */
+    unsigned char *data; /* value serialized for another VM */
+} chan_slot_t;
+
+/* The two positions sit on their own cache lines, so that the sending and
+   the receiving threads do not invalidate each other's */
+struct jk_chan {
+    size_t send_pos;
+    char pad0[CHAN_CACHE_LINE - sizeof(size_t)];
+    size_t recv_pos;
+    char pad1[CHAN_CACHE_LINE - sizeof(size_t)];
+    size_t mask;
+    size_t capacity; /* values held at most, no more than mask + 1 */
+    unsigned int refs;
+    int shared;
+    jk_fiber_queue_t senders, receivers; /* local channels only */
+    chan_slot_t slots[];
+};
+
+/* Serialization ************************************************************/
+
+/* Values going to another VM are written depth first into one buffer:
+   a tag byte, then the payload of the tag. Immediates other than words are
+   copied as they are; words travel by name since each VM numbers them. */
+
+enum {
+    MSG_IMMEDIATE, /* jk_object_t */
+    MSG_INT,       /* JK_INT_CTYPE */
+    MSG_WORD,      /* size_t length, chars */
+    MSG_STRING,    /* size_t length, chars */
+    MSG_QUOTATION, /* size_t count, items */
+    MSG_BUILTIN,   /* function pointer */
+    MSG_ERROR,     /* item */
+    MSG_CHAN,      /* jk_chan_t *, holding a reference */
+    MSG_BIGINT,    /* size_t size, jk_bigint_t */
+    MSG_VECTOR,    /* size_t length, int64_t items */
+};
+
+typedef struct msg_buf {
+    unsigned char *data;
+    size_t used, size;
+    jk_chan_t **chans; /* retained by the message */
+    size_t chans_count, chans_size;
+} msg_buf_t;
+
+static void msg_write(msg_buf_t *b, const void *src, size_t len) {
+    if (b->used + len > b->size) {
+        while (b->used + len > b->size)
+            b->size = b->size ? b->size * 2 : 64;
+        b->data = (unsigned char *)realloc(b->data, b->size);
+        if (!b->data)
+            jiko_panic("msg_write: realloc failed");
+    }
+    memcpy(&b->data[b->used], src, len);
+    b->used += len;
+}
+
+static void msg_tag(msg_buf_t *b, unsigned char tag) { msg_write(b, &tag, 1); }
+
+static void msg_size(msg_buf_t *b, size_t n) { msg_write(b, &n, sizeof(n)); }
+
+/* Values other than quotations and errors */
+static int msg_encode_atom(msg_buf_t *b, jk_object_t j) {
+    switch (jk_get_type(j)) {
+    case JK_WORD: {
+        const char *str = word_to_string(AS_WORD(j));
+        size_t len = strlen(str);
+        msg_tag(b, MSG_WORD);
+        msg_size(b, len);
+        msg_write(b, str, len);
+        return 1;
+    }
+    case JK_INT:
+        if (j < 0)
+            break;
+        msg_tag(b, MSG_INT);
+        msg_write(b, &JK_CELL(j).value.as_int, sizeof(JK_INT_CTYPE));
+        return 1;
+    case JK_STRING: {
+        size_t len = jk_string_length(j);
+        msg_tag(b, MSG_STRING);
+        msg_size(b, len);
+        msg_write(b, jk_string_chars(j), len);
+        return 1;
+    }
+    case JK_BIGINT:
+        msg_tag(b, MSG_BIGINT);
+        msg_size(b, jk_bigint_size(AS_BIGINT(j)));
+        msg_write(b, AS_BIGINT(j), jk_bigint_size(AS_BIGINT(j)));
+        return 1;
+    case JK_VECTOR:
+        msg_tag(b, MSG_VECTOR);
+        msg_size(b, AS_VECTOR(j)->len);
+        msg_write(b, AS_VECTOR(j)->items, sizeof(int64_t) * AS_VECTOR(j)->len);
+        return 1;
+    case JK_BUILTIN:
+        msg_tag(b, MSG_BUILTIN);
+        msg_write(b, &AS_BUILTIN(j), sizeof(AS_BUILTIN(j)));
+        return 1;
+    case JK_CHANNEL:
+        /* the slots and wait queues of a local channel hold the cells and
+           fibers of its VM */
+        if (!AS_CHAN(j)->shared)
+            return 0;
+        if (b->chans_count >= b->chans_size) {
+            b->chans_size = b->chans_size ? b->chans_size * 2 : 4;
+            b->chans = (jk_chan_t **)realloc(
+                b->chans, sizeof(jk_chan_t *) * b->chans_size);
+            if (!b->chans)
+                jiko_panic("msg_encode_atom: realloc failed");
+        }
+        jk_chan_retain(AS_CHAN(j));
+        b->chans[b->chans_count++] = AS_CHAN(j);
+        msg_tag(b, MSG_CHAN);
+        msg_write(b, &AS_CHAN(j), sizeof(jk_chan_t *));
+        return 1;
+    case JK_FIBER:
+        return 0; /* a fiber cannot leave its VM */
+    default:
+        break;
+    }
+    msg_tag(b, MSG_IMMEDIATE);
+    msg_write(b, &j, sizeof(j));
+    return 1;
+}
+
+/* An open quotation. Encoding walks the rest of its list; decoding builds
+   its list, with left items to go and errors tags to wrap it in. */
+typedef struct msg_frame {
+    jk_object_t rest, head, tail;
+    size_t left, errors;
+} msg_frame_t;
+
+typedef struct msg_stack {
+    msg_frame_t *items;
+    size_t size, capacity;
+} msg_stack_t;
+
+static msg_frame_t *msg_push(msg_stack_t *st) {
+    if (st->size >= st->capacity) {
+        st->capacity = st->capacity ? st->capacity * 2 : 16;
+        st->items = (msg_frame_t *)realloc(
+            st->items, sizeof(msg_frame_t) * st->capacity);
+        if (!st->items)
+            jiko_panic("msg_push: realloc failed");
+    }
+    return &st->items[st->size++];
+}
+
+/* Iterative, so that deeply nested values do not grow the C stack */
+static int msg_encode(msg_buf_t *b, jk_object_t j) {
+    msg_stack_t st = {NULL, 0, 0};
+    int ok = 1;
+    for (;;) {
+        while (jk_get_type(j) == JK_ERROR) {
+            msg_tag(b, MSG_ERROR);
+            j = AS_ERROR(j);
+        }
+        if (jk_get_type(j) == JK_QUOTATION) {
+            size_t count = 0;
+            for (jk_object_t ji = j; ji != JK_NIL; ji = CDR(ji))
+                count++;
+            msg_tag(b, MSG_QUOTATION);
+            msg_size(b, count);
+            msg_push(&st)->rest = j;
+        } else if (!msg_encode_atom(b, j)) {
+            ok = 0;
+            break;
+        }
+        while (st.size && st.items[st.size - 1].rest == JK_NIL)
+            st.size--;
+        if (!st.size)
+            break;
+        msg_frame_t *fr = &st.items[st.size - 1];
+        j = CAR(fr->rest);
+        fr->rest = CDR(fr->rest);
+    }
+    free(st.items);
+    return ok;
+}
+
+static void msg_read(const unsigned char **p, void *dst, size_t len) {
+    memcpy(dst, *p, len);
+    *p += len;
+}
+
+static size_t msg_read_size(const unsigned char **p) {
+    size_t n;
+    msg_read(p, &n, sizeof(n));
+    return n;
+}
+
+/* Values other than quotations and errors, after their tag */
+static jk_object_t msg_decode_atom(const unsigned char **p,
+                                   unsigned char tag) {
+    switch (tag) {
+    case MSG_IMMEDIATE: {
+        jk_object_t j;
+        msg_read(p, &j, sizeof(j));
+        return j;
+    }
+    case MSG_INT: {
+        JK_INT_CTYPE i;
+        msg_read(p, &i, sizeof(i));
+        return jk_make_int(i);
+    }
+    case MSG_BIGINT: {
+        size_t size = msg_read_size(p);
+        jk_bigint_t *big = (jk_bigint_t *)malloc(size);
+        if (!big)
+            jiko_panic("msg_decode_atom: malloc failed");
+        msg_read(p, big, size);
+        return jk_make_bigint(big);
+    }
+    case MSG_VECTOR: {
+        jk_vector_t *v = jk_vector_new(msg_read_size(p));
+        msg_read(p, v->items, sizeof(int64_t) * v->len);
+        return jk_make_vector(v);
+    }
+    case MSG_WORD: {
+        size_t len = msg_read_size(p);
+        jk_object_t res = jk_make_word(word_from_chars((const char *)*p, len));
+        *p += len;
+        return res;
+    }
+    case MSG_STRING: {
+        size_t len = msg_read_size(p);
+        const char *chars = (const char *)*p;
+        *p += len;
+        return jk_make_string_chars(chars, len);
+    }
+    case MSG_BUILTIN: {
+        void (*fn)(jk_fiber_t *);
+        msg_read(p, &fn, sizeof(fn));
+        return jk_make_builtin(fn);
+    }
+    case MSG_CHAN: {
+        jk_chan_t *c;
+        msg_read(p, &c, sizeof(c));
+        jk_object_t res = jk_make_chan(c);
+        jk_chan_release(c);
+        return res;
+    }
+    default:
+        assert(0 && "unreachable");
+        return JK_UNDEFINED;
+    }
+}
+
+/* Rebuilds a value in the heap of the current VM. The references held by
+   the message on channels are handed over to the new cells. */
+static jk_object_t msg_decode(const unsigned char **p) {
+    msg_stack_t st = {NULL, 0, 0};
+    for (;;) {
+        size_t errors = 0;
+        unsigned char tag;
+        jk_object_t j = JK_NIL;
+        while ((tag = *(*p)++) == MSG_ERROR)
+            errors++;
+        if (tag != MSG_QUOTATION) {
+            j = msg_decode_atom(p, tag);
+        } else {
+            size_t count = msg_read_size(p);
+            if (count) {
+                msg_frame_t *fr = msg_push(&st);
+                fr->head = fr->tail = JK_NIL;
+                fr->left = count;
+                fr->errors = errors;
+                continue;
+            }
+        }
+        /* j is complete, and so may be the quotations it ends */
+        for (;;) {
+            for (; errors; errors--)
+                j = jk_make_error(j);
+            if (!st.size) {
+                free(st.items);
+                return j;
+            }
+            msg_frame_t *fr = &st.items[st.size - 1];
+            jk_object_t cell = jk_make_pair(j, JK_NIL);
+            if (fr->tail == JK_NIL)
+                fr->head = cell;
+            else
+                CDR(fr->tail) = cell;
+            fr->tail = cell;
+            if (--fr->left)
+                break;
+            j = fr->head;
+            errors = fr->errors;
+            st.size--;
+        }
+    }
+}
+
+/* Drops the references a message that is never received holds. The items
+   of a quotation follow its count, so counting the items left to skip is
+   enough to find the end of the message. */
+static void msg_release(const unsigned char **p) {
+    for (size_t left = 1; left; left--) {
+        unsigned char tag = *(*p)++;
+        switch (tag) {
+        case MSG_IMMEDIATE:
+            *p += sizeof(jk_object_t);
+            break;
+        case MSG_INT:
+            *p += sizeof(JK_INT_CTYPE);
+            break;
+        case MSG_WORD:
+        case MSG_STRING:
+        case MSG_BIGINT:
+            *p += msg_read_size(p);
+            break;
+        case MSG_VECTOR:
+            *p += sizeof(int64_t) * msg_read_size(p);
+            break;
+        case MSG_QUOTATION:
+            left += msg_read_size(p);
+            break;
+        case MSG_BUILTIN:
+            *p += sizeof(void (*)(jk_fiber_t *));
+            break;
+        case MSG_ERROR:
+            left++;
+            break;
+        case MSG_CHAN: {
+            jk_chan_t *c;
+            msg_read(p, &c, sizeof(c));
+            jk_chan_release(c);
+            break;
+        }
+        default:
+            assert(0 && "unreachable");
+        }
+    }
+}
+
+static void msg_free(unsigned char *data) {
+    const unsigned char *p = data;
+    msg_release(&p);
+    free(data);
+}
+
+/* Channels *****************************************************************/
+
+jk_chan_t *jk_chan_new(size_t capacity, int shared) {
+    /* with a single slot, "full for position p" and "free for position
+       p + 1" would have the same sequence */
+    size_t size = 2;
+    void *mem;
+    /* keeps the doubling and the size of the ring below from overflowing */
+    if (capacity == 0 || capacity > JK_CHAN_MAX_CAPACITY)
+        jiko_panic("jk_chan_new: capacity out of range");
+    while (size < capacity)
+        size *= 2;
+    if (posix_memalign(&mem, CHAN_CACHE_LINE,
+                       sizeof(jk_chan_t) + sizeof(chan_slot_t) * size))
+        jiko_panic("jk_chan_new: posix_memalign failed");
+    jk_chan_t *c = (jk_chan_t *)mem;
+    c->send_pos = c->recv_pos = 0;
+    c->mask = size - 1;
+    c->capacity = capacity;
+    c->refs = 1;
+    c->shared = shared;
+    c->senders.head = c->senders.tail = NULL;
+    c->receivers.head = c->receivers.tail = NULL;
+    for (size_t i = 0; i < size; i++) {
+        c->slots[i].seq = i;
+        c->slots[i].data = NULL;
+    }
+    return c;
+}
+
+void jk_chan_retain(jk_chan_t *c) { CHAN_ADD(&c->refs, 1); }
+
+void jk_chan_release(jk_chan_t *c) {
+    if (CHAN_ADD(&c->refs, -1) != 0)
+        return;
+    /* messages left in the ring, the values of a local channel are on the
+       heap */
+    for (size_t pos = c->recv_pos; pos != c->send_pos; pos++) {
+        chan_slot_t *slot = &c->slots[pos & c->mask];
+        if (slot->data)
+            msg_free(slot->data);
+    }
+    free(c);
+}
+
+int jk_chan_is_shared(jk_chan_t *c) { return c->shared; }
+
+jk_object_t jk_make_chan(jk_chan_t *c) {
+    jk_object_t res = jk_object_alloc();
+    jk_set_type(res, JK_CHANNEL);
+    AS_CHAN(res) = c;
+    jk_chan_retain(c);
+    return res;
+}
+
+/* Serializes j for a shared channel. Returns NULL if j is an immediate
+   that can be sent as it is, and sets *ok to 0 if j cannot be sent. */
+static unsigned char *chan_serialize(jk_object_t j, int *ok) {
+    msg_buf_t b = {NULL, 0, 0, NULL, 0, 0};
+    *ok = 1;
+    if (j < 0 && !JK_IS_IMM_WORD(j))
+        return NULL;
+    if (!msg_encode(&b, j)) {
+        for (size_t i = 0; i < b.chans_count; i++)
+            jk_chan_release(b.chans[i]);
+        free(b.data);
+        b.data = NULL;
+        *ok = 0;
+    }
+    free(b.chans);
+    return b.data;
+}
+
+/* Whether capacity values are held before position pos. recv_pos only
+   grows, so a stale one can only make the channel look fuller. */
+static int chan_at_capacity(jk_chan_t *c, size_t pos) {
+    return (ptrdiff_t)(pos - CHAN_LOAD(&c->recv_pos)) >=
+           (ptrdiff_t)c->capacity;
+}
+
+static int chan_full(jk_chan_t *c) {
+    size_t pos = CHAN_LOAD(&c->send_pos);
+    return chan_at_capacity(c, pos) ||
+           (ptrdiff_t)(CHAN_LOAD(&c->slots[pos & c->mask].seq) - pos) < 0;
+}
+
+int jk_chan_try_send(jk_chan_t *c, jk_object_t j) {
+    unsigned char *data = NULL;
+    if (c->shared) {
+        int ok;
+        /* do not serialize for nothing */
+        if (chan_full(c))
+            return 0;
+        data = chan_serialize(j, &ok);
+        if (!ok)
+            return -1;
+    }
+
+    size_t pos = CHAN_LOAD(&c->send_pos);
+    chan_slot_t *slot;
+    for (;;) {
+        slot = &c->slots[pos & c->mask];
+        size_t seq = CHAN_LOAD(&slot->seq);
+        if (seq == pos && !chan_at_capacity(c, pos)) {
+            if (CHAN_CAS(&c->send_pos, &pos, pos + 1))
+                break;
+        } else if (seq == pos || (ptrdiff_t)(seq - pos) < 0) {
+            /* filled meanwhile */
+            if (data)
+                msg_free(data);
+            return 0;
+        } else {
+            pos = CHAN_LOAD(&c->send_pos);
+        }
+    }
+    slot->value = data ? JK_UNDEFINED : j;
+    slot->data = data;
+    CHAN_STORE(&slot->seq, pos + 1);
+    return 1;
+}
+
+int jk_chan_try_recv(jk_chan_t *c, jk_object_t *res) {
+    size_t pos = CHAN_LOAD(&c->recv_pos);
+    chan_slot_t *slot;
+    for (;;) {
+        slot = &c->slots[pos & c->mask];
+        size_t seq = CHAN_LOAD(&slot->seq);
+        if (seq == pos + 1) {
+            if (CHAN_CAS(&c->recv_pos, &pos, pos + 1))
+                break;
+        } else if ((ptrdiff_t)(seq - (pos + 1)) < 0) { /* empty */
+            return 0;
+        } else {
+            pos = CHAN_LOAD(&c->recv_pos);
+        }
+    }
+    unsigned char *data = slot->data;
+    jk_object_t value = slot->value;
+    slot->data = NULL;
+    /* the slot goes back to the senders before the value is rebuilt */
+    CHAN_STORE(&slot->seq, pos + c->mask + 1);
+    if (data) {
+        const unsigned char *p = data;
+        value = msg_decode(&p);
+        free(data);
+    }
+    *res = value;
+    return 1;
+}
+
+jk_fiber_queue_t *jk_chan_senders(jk_chan_t *c) { return &c->senders; }
+
+jk_fiber_queue_t *jk_chan_receivers(jk_chan_t *c) { return &c->receivers; }
+
+void jk_chan_mark(jk_chan_t *c, void (*mark)(void *, jk_object_t),
+                  void *ctx) {
+    if (c->shared)
+        return;
+    for (size_t pos = c->recv_pos; pos != c->send_pos; pos++)
+        mark(ctx, c->slots[pos & c->mask].value);
+}
+
+#undef CHAN_LOAD
+#undef CHAN_STORE
+#undef CHAN_CAS
+#undef CHAN_ADD
@@ -0,0 +1,47 @@
+#ifndef CHAN_H
+#define CHAN_H
+
+#include "types.h"
+#include <stddef.h>
+
+/* Channels are bounded FIFO queues of values. A local channel belongs to
+   one VM and carries the values themselves; the fibers of that VM block
+   on it when it is full or empty. A shared channel can be boxed in several
+   VMs running on different threads: values are serialized by the sender
+   and rebuilt in the heap of the receiver, and fibers retry at their next
+   time slice instead of blocking. */
+
+typedef struct jk_chan jk_chan_t;
+
+#define JK_CHAN_LOCAL 0
+#define JK_CHAN_SHARED 1
+
+/* The ring of a channel is allocated up front, a slot for each value */
+#define JK_CHAN_MAX_CAPACITY ((size_t)1 << 20)
+
+/* The channel holds up to capacity values, from 1 to JK_CHAN_MAX_CAPACITY.
+   The new channel has one reference, owned by the caller. */
+jk_chan_t *jk_chan_new(size_t capacity, int shared);
+void jk_chan_retain(jk_chan_t *c);
+void jk_chan_release(jk_chan_t *c);
+int jk_chan_is_shared(jk_chan_t *c);
+
+/* Boxes c in the current VM. The cell takes a reference of its own. */
+jk_object_t jk_make_chan(jk_chan_t *c);
+
+/* Returns 1 on success, 0 when the channel is full, -1 when j cannot be
+   sent to another VM (it holds a fiber or a local channel) */
+int jk_chan_try_send(jk_chan_t *c, jk_object_t j);
+/* Returns 1 and the value in *res on success, 0 when the channel is
+   empty */
+int jk_chan_try_recv(jk_chan_t *c, jk_object_t *res);
+
+/* Wait queues of the fibers blocked on a local channel */
+jk_fiber_queue_t *jk_chan_senders(jk_chan_t *c);
+jk_fiber_queue_t *jk_chan_receivers(jk_chan_t *c);
+
+/* Calls mark(ctx, j) on each value j held by a local channel */
+void jk_chan_mark(jk_chan_t *c, void (*mark)(void *, jk_object_t),
+                  void *ctx);
+
+#endif
@@ -0,0 +1,138 @@
+#include "compile.h"
+#include "env.h"
+#include "heap.h"
+#include "lib.h"
+#include "misc.h"
+#include "types.h"
+#include "vm.h"
+#include "word_table.h"
+#include <assert.h>
+#include <stdlib.h>
+
+/* Compiled quotations are referenced from their head cell by
+   JK_CELL(q).code, which holds 1 + their index in the code table of the VM
+   (0 when not compiled). Indices of the free slots of the table are
+   stacked in its free array. */
+
+static int code_register(jk_code_t *code) {
+    jk_code_table_t *t = &jk_vm->codes;
+    size_t i;
+    if (t->free_count) {
+        i = t->free[--t->free_count];
+    } else {
+        if (t->used >= t->size) {
+            t->size = t->size ? t->size * 2 : 256;
+            t->codes = (jk_code_t **)realloc(t->codes,
+                                             sizeof(jk_code_t *) * t->size);
+            t->free = (size_t *)realloc(t->free, sizeof(size_t) * t->size);
+            if (!t->codes || !t->free)
+                jiko_panic("code_register: realloc failed");
+        }
+        i = t->used++;
+    }
+    t->codes[i] = code;
+    return (int)i + 1;
+}
+
+void jk_code_release(int code) {
+    jk_code_table_t *t = &jk_vm->codes;
+    assert(code > 0 && (size_t)code <= t->used);
+    free(t->codes[code - 1]);
+    t->codes[code - 1] = NULL;
+    t->free[t->free_count++] = (size_t)code - 1;
+}
+
+void jk_code_free_all() {
+    jk_code_table_t *t = &jk_vm->codes;
+    for (size_t i = 0; i < t->used; i++)
+        free(t->codes[i]);
+    free(t->codes);
+    free(t->free);
+    t->codes = NULL;
+    t->free = NULL;
+    t->size = t->used = t->free_count = 0;
+}
+
+/* Superinstructions *********************************************************/
+
+static int is_word(jk_insn_t *insn, const char *name) {
+    return insn->plain_op == JK_OP_WORD &&
+           AS_WORD(insn->obj) == word_from_string(name);
+}
+
+static int is_int(jk_insn_t *insn) {
+    return insn->plain_op == JK_OP_PUSH && jk_get_type(insn->obj) == JK_INT;
+}
+
+static int is_quotation(jk_insn_t *insn) {
+    return insn->plain_op == JK_OP_PUSH &&
+           (jk_get_type(insn->obj) == JK_QUOTATION || insn->obj == JK_NIL);
+}
+
+static void fuse(jk_insn_t *insn, jk_opcode op, unsigned char width) {
+    insn->op = op;
+    insn->width = width;
+}
+
+/* Only the first instruction of a fused sequence changes, the following ones
+   still run on their own when ' skips into the middle of it or when the
+   superinstruction falls back */
+static void peephole(jk_code_t *code) {
+    jk_insn_t *in = code->insns;
+    for (size_t i = 0; i < code->len; i++) {
+        size_t left = code->len - i;
+        if (left >= 3 && is_quotation(&in[i]) && is_quotation(&in[i + 1]) &&
+            is_word(&in[i + 2], "ifte"))
+            fuse(&in[i], JK_OP_IFTE, 3);
+        else if (left >= 2 && is_word(&in[i], "dup") &&
+                 is_word(&in[i + 1], "*"))
+            fuse(&in[i], JK_OP_DUP_MUL, 2);
+        else if (left >= 2 && is_int(&in[i]) && is_word(&in[i + 1], "+"))
+            fuse(&in[i], JK_OP_ADD_K, 2);
+        else if (left >= 2 && is_int(&in[i]) && is_word(&in[i + 1], "-"))
+            fuse(&in[i], JK_OP_SUB_K, 2);
+        else if (left >= 2 && is_int(&in[i]) && is_word(&in[i + 1], "="))
+            fuse(&in[i], JK_OP_EQ_K, 2);
+    }
+}
+
+/* Compiler ******************************************************************/
+
+jk_code_t *jk_compile(jk_object_t q) {
+    assert(jk_get_type(q) == JK_QUOTATION);
+    if (JK_CELL(q).code)
+        return jk_vm->codes.codes[JK_CELL(q).code - 1];
+
+    size_t len = 0;
+    for (jk_object_t ji = q; ji != JK_NIL; ji = CDR(ji))
+        len++;
+    jk_code_t *code =
+        (jk_code_t *)malloc(sizeof(jk_code_t) + sizeof(jk_insn_t) * len);
+    if (!code)
+        jiko_panic("jk_compile: malloc failed");
+    code->quotation = q;
+    code->len = len;
+
+    jk_insn_t *insn = code->insns;
+    for (jk_object_t ji = q; ji != JK_NIL; ji = CDR(ji), insn++) {
+        jk_object_t j = CAR(ji);
+        switch (jk_get_type(j)) {
+        case JK_WORD:
+            insn->op = JK_OP_WORD;
+            break;
+        case JK_BUILTIN:
+            insn->op = JK_OP_BUILTIN;
+            break;
+        default:
+            insn->op = JK_OP_PUSH;
+            break;
+        }
+        insn->plain_op = insn->op;
+        insn->width = 1;
+        insn->obj = j;
+        jk_env_cache_init(&insn->cache);
+    }
+    peephole(code);
+    JK_CELL(q).code = code_register(code);
+    return code;
+}
@@ -0,0 +1,65 @@
+#ifndef COMPILE_H
+#define COMPILE_H
+
+#include "env.h"
+#include "types.h"
+#include <stddef.h>
+
+/* Bytecode *******************************************************************/
+
+/* A quotation is compiled, on its first call, to one instruction per item,
+   so that a frame position still designates an item of the quotation (the
+   ' builtin reads the next item, not the next instruction). Superinstructions
+   replace the first instruction of the sequence they fuse and keep the plain
+   one in plain_op: they check at run time that the words they stand for
+   still resolve to the expected builtins, and fall back to plain_op when
+   they do not. */
+
+typedef enum jk_opcode {
+    JK_OP_PUSH,    /* push obj */
+    JK_OP_BUILTIN, /* call the builtin obj */
+    JK_OP_WORD,    /* call the word obj */
+    /* superinstructions */
+    JK_OP_DUP_MUL, /* dup * */
+    JK_OP_ADD_K,   /* <int> + */
+    JK_OP_SUB_K,   /* <int> - */
+    JK_OP_EQ_K,    /* <int> = */
+    JK_OP_IFTE,    /* [..] [..] ifte */
+    JK_OP_COUNT
+} jk_opcode;
+
+typedef struct jk_insn {
+    unsigned char op, plain_op;
+    unsigned char width; /* number of items executed by op */
+    jk_object_t obj;     /* the item of the quotation */
+    jk_env_cache_t cache; /* resolution of JK_OP_WORD */
+} jk_insn_t;
+
+typedef struct jk_code {
+    jk_object_t quotation;
+    size_t len;
+    jk_insn_t insns[];
+} jk_code_t;
+
+/* Compiled code of a VM, see compile.c */
+typedef struct jk_code_table {
+    jk_code_t **codes;
+    size_t size, used;
+    size_t *free;
+    size_t free_count;
+} jk_code_table_t;
+
+/* Returns the code of a non-empty quotation, compiling it on first use. The
+   code lives as long as the quotation cell. */
+jk_code_t *jk_compile(jk_object_t q);
+
+/* Called by the collector when a compiled quotation cell dies */
+void jk_code_release(int code);
+void jk_code_free_all();
+
+/* Resolves the word of insn through its cache. Returns 0 if the word is
+   undefined. */
+#define jk_insn_resolve(f, insn)                                               \
+    jk_lookup_cached((f), AS_WORD((insn)->obj), &(insn)->cache)
+
+#endif
@@ -1,64 +1,152 @@
 #include "env.h"
+#include "misc.h"
+#include "vm.h"
 #include <assert.h>
+#include <stdlib.h>
 
-/* env = [
-    [
-        [$3 . [a b c d]]
-        [$1 . [1 2 3]]
-    ]
-    [
-        [$5 . [[$3 $2] $4]]
-        [$2 . []]
-    ]
+/* env = scope -> parent scope -> ... -> NULL
 
-]
-
-"type" : env = [[[ word . [] ]]]
+   scope = {
+       entries = [ {$3, v0, [a b c d]}, {$1, v2, [1 2 3]} ]
+       slots   = [ 0 2 0 0 1 0 0 0 ]   (hash of the word -> 1 + entry)
+   }
 
 words = {
     $1 "+"
     $2 "*"
     $3 "dup"
-    $4 "call"
-    $5 "square"
 }
 
 */
 
-/* Looks up in only one level of the environment stack */
-static jk_object_t jk_lookup_env(jk_object_t env, word_t w) {
-    for (jk_object_t ji = env; ji != JK_NIL; ji = CDR(ji)) {
-        assert(CAR(ji) != JK_NIL);
-        if (AS_WORD(CAAR(ji)) == w)
-            return CDAR(ji);
+#define HASH(w) ((unsigned int)(w)*2654435761u)
+
+jk_env_t *jk_env_new(jk_env_t *parent) {
+    jk_env_t *res = (jk_env_t *)malloc(sizeof(jk_env_t));
+    assert(res && "jk_env_new: malloc failed");
+    res->parent = parent;
+    res->refs = 1;
+    if (parent)
+        parent->refs++;
+    res->entries = NULL;
+    res->count = res->capacity = 0;
+    res->slots_size = 32;
+    res->slots = (unsigned int *)calloc(res->slots_size, sizeof(unsigned int));
+    assert(res->slots && "jk_env_new: calloc failed");
+    return res;
+}
+
+void jk_env_release(jk_env_t *env) {
+    while (env && --env->refs == 0) {
+        jk_env_t *parent = env->parent;
+        free(env->entries);
+        free(env->slots);
+        free(env);
+        jk_vm->env_shape++;
+        env = parent;
     }
-    return JK_UNDEFINED;
+}
+
+/* Returns the slot holding w, or the empty slot where w would go */
+static unsigned int *env_slot(jk_env_t *env, word_t w) {
+    size_t mask = env->slots_size - 1;
+    for (size_t i = HASH(w) & mask;; i = (i + 1) & mask) {
+        unsigned int *slot = &env->slots[i];
+        if (*slot == 0 || env->entries[*slot - 1].word == w)
+            return slot;
+    }
+}
+
+static void env_rehash(jk_env_t *env) {
+    free(env->slots);
+    env->slots_size *= 2;
+    env->slots =
+        (unsigned int *)calloc(env->slots_size, sizeof(unsigned int));
+    if (!env->slots)
+        jiko_panic("env_rehash: calloc failed");
+    for (size_t i = 0; i < env->count; i++)
+        *env_slot(env, env->entries[i].word) = (unsigned int)i + 1;
+}
+
+void jk_env_define(jk_env_t *env, word_t w, jk_object_t body) {
+    unsigned int *slot = env_slot(env, w);
+    if (*slot) {
+        jk_env_entry_t *e = &env->entries[*slot - 1];
+        e->body = body;
+        e->version++;
+        return;
+    }
+    if (env->count >= env->capacity) {
+        env->capacity = env->capacity ? env->capacity * 2 : 32;
+        env->entries = (jk_env_entry_t *)realloc(
+            env->entries, sizeof(jk_env_entry_t) * env->capacity);
+        if (!env->entries)
+            jiko_panic("jk_env_define: realloc failed");
+    }
+    jk_env_entry_t *e = &env->entries[env->count++];
+    e->word = w;
+    e->version = 0;
+    e->body = body;
+    *slot = (unsigned int)env->count;
+    /* keep the load factor under 1/2 */
+    if (env->count * 2 > env->slots_size)
+        env_rehash(env);
+    jk_vm->env_shape++;
 }
 
 void jk_define(jk_fiber_t *f, jk_object_t w, jk_object_t body) {
-    jk_object_t env_stack = f->env_stack;
-    assert(env_stack != JK_NIL);
-    jk_object_t top_level = CAR(env_stack);
-    /* TODO: implement old definition replacement */
-    /*
-    jk_object_t prev = jk_lookup_env(top_level, w);
-    if(prev == JK_UNDEFINED) {
-    */
-    jk_object_t entry = jk_make_pair(w, body);
-    top_level = jk_make_pair(entry, top_level);
-    CAR(env_stack) = top_level;
-    /*
+    jk_env_define(f->env, AS_WORD(w), body);
+}
+
+static int env_find(jk_env_t *env, word_t w, jk_env_t **scope,
+                    size_t *index) {
+    for (; env; env = env->parent) {
+        unsigned int slot = *env_slot(env, w);
+        if (slot) {
+            *scope = env;
+            *index = slot - 1;
+            return 1;
+        }
     }
-    */
+    return 0;
 }
 
 jk_object_t jk_lookup(jk_fiber_t *f, word_t w) {
-    jk_object_t env_stack = f->env_stack;
-    assert(env_stack != JK_NIL);
-    for (jk_object_t ji = env_stack; ji != JK_NIL; ji = CDR(ji)) {
-        jk_object_t res = jk_lookup_env(CAR(ji), w);
-        if (res != JK_UNDEFINED)
-            return res;
+    jk_env_t *scope;
+    size_t index;
+    if (!env_find(f->env, w, &scope, &index))
+        return JK_UNDEFINED;
+    return scope->entries[index].body;
+}
+
+void jk_env_cache_init(jk_env_cache_t *c) {
+    c->env = c->scope = NULL;
+    c->shape = c->version = 0;
+    c->index = 0;
+    c->body = JK_UNDEFINED;
+    c->builtin = NULL;
+}
+
+int jk_lookup_cached(jk_fiber_t *f, word_t w, jk_env_cache_t *c) {
+    if (c->env == f->env && c->shape == jk_vm->env_shape &&
+        c->scope->entries[c->index].version == c->version)
+        return 1;
+    if (!env_find(f->env, w, &c->scope, &c->index)) {
+        c->env = NULL;
+        return 0;
     }
-    return JK_UNDEFINED;
-}
\ No newline at end of file
+    jk_env_entry_t *e = &c->scope->entries[c->index];
+    c->env = f->env;
+    c->shape = jk_vm->env_shape;
+    c->version = e->version;
+    c->body = e->body;
+    assert(jk_get_type(c->body) == JK_QUOTATION);
+    /* bodies of builtins are [builtin]: they can be called without a frame */
+    if (CDR(c->body) == JK_NIL && jk_get_type(CAR(c->body)) == JK_BUILTIN)
+        c->builtin = AS_BUILTIN(CAR(c->body));
+    else
+        c->builtin = NULL;
+    return 1;
+}
+
+#undef HASH
@@ -1,4 +1,48 @@
+#ifndef ENV_H
+#define ENV_H
+
 #include "types.h"
 
+/* An environment is a chain of scopes. Each scope indexes its definitions
+   with an open addressing hash table keyed by word_t. Redefining a word
+   replaces its body in place and increments the version of its entry. */
+
+typedef struct jk_env_entry {
+    word_t word;
+    unsigned int version; /* incremented by each redefinition */
+    jk_object_t body;
+} jk_env_entry_t;
+
+typedef struct jk_env {
+    struct jk_env *parent;
+    unsigned int refs; /* fibers and child scopes using it */
+    jk_env_entry_t *entries; /* in definition order */
+    size_t count, capacity;
+    unsigned int *slots; /* 1 + index in entries, 0 when empty */
+    size_t slots_size;   /* power of two */
+} jk_env_t;
+
+/* Resolution cache for one call site. It remains valid while the shape of
+   the VM (jk_vm->env_shape) is unchanged and the entry it found keeps its
+   version. The shape is incremented whenever a scope gains a new word or is
+   freed, since that may change what a lookup finds. */
+typedef struct jk_env_cache {
+    jk_env_t *env, *scope;
+    unsigned int shape, version;
+    size_t index;
+    jk_object_t body;
+    void (*builtin)(jk_fiber_t *); /* set when body is [builtin] */
+} jk_env_cache_t;
+
+/* The new scope holds a reference on its parent */
+jk_env_t *jk_env_new(jk_env_t *parent);
+void jk_env_release(jk_env_t *env);
+void jk_env_define(jk_env_t *env, word_t w, jk_object_t body);
+/* Defines w in the scope of the fiber */
 void jk_define(jk_fiber_t *f, jk_object_t w, jk_object_t body);
-jk_object_t jk_lookup(jk_fiber_t *f, word_t w);
\ No newline at end of file
+jk_object_t jk_lookup(jk_fiber_t *f, word_t w);
+void jk_env_cache_init(jk_env_cache_t *c);
+/* Returns 0 if w is undefined, otherwise fills c */
+int jk_lookup_cached(jk_fiber_t *f, word_t w, jk_env_cache_t *c);
+
+#endif
@@ -1,36 +1,105 @@
 #include "eval.h"
+#include "bigint.h"
+#include "compile.h"
 #include "env.h"
 #include "heap.h"
 #include "io.h"
+#include "lib.h"
+#include "profile.h"
+#include "trace.h"
+#include "misc.h"
 #include "types.h"
+#include "vm.h"
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+/* Items come from the innermost call frame, then from the queue of
+   input. Quotations are shared and never mutated: calling one pushes a
+   frame on its compiled code, and evaluating an item only moves the frame
+   forward, so no step allocates. */
 
 void jk_fiber_enqueue(jk_fiber_t *f, jk_object_t j) {
-    f->queue = jk_append(f->queue, j);
+    jk_object_t cell = jk_make_pair(j, JK_NIL);
+    if (f->queue == JK_NIL)
+        f->queue = cell;
+    else
+        CDR(f->queue_tail) = cell;
+    f->queue_tail = cell;
 }
 
 jk_object_t jk_fiber_dequeue(jk_fiber_t *f) {
+    jk_object_t res;
+    if (f->frames.size) {
+        jk_frame_t *fr = &f->frames.items[f->frames.size - 1];
+        res = fr->code->insns[fr->ip].obj;
+        /* a finished frame is popped before its last item runs, so tail
+           calls reuse the caller's slot */
+        if (++fr->ip == fr->code->len)
+            f->frames.size--;
+        return res;
+    }
     if (f->queue == JK_NIL)
         return JK_EOF;
-    else {
-        assert(jk_get_type(f->queue) == JK_QUOTATION);
-        jk_object_t res = CAR(f->queue);
-        jk_object_t garbage = f->queue;
-        f->queue = CDR(f->queue);
-        CAR(garbage) = JK_NIL;
-        CDR(garbage) = JK_NIL;
-        jk_object_free(garbage);
-        return res;
+    assert(jk_get_type(f->queue) == JK_QUOTATION);
+    res = CAR(f->queue);
+    f->queue = CDR(f->queue);
+    if (f->queue == JK_NIL)
+        f->queue_tail = JK_NIL;
+    return res;
+}
+
+void jk_fiber_call(jk_fiber_t *f, jk_object_t q) {
+    jk_frames_t *fs = &f->frames;
+    if (q == JK_NIL)
+        return;
+    if (fs->size >= fs->capacity) {
+        fs->capacity = fs->capacity ? fs->capacity * 2 : 16;
+        fs->items = (jk_frame_t *)realloc(fs->items,
+                                          sizeof(jk_frame_t) * fs->capacity);
+        if (!fs->items)
+            jiko_panic("jk_fiber_call: realloc failed");
     }
+    fs->items[fs->size].code = jk_compile(q);
+    fs->items[fs->size].ip = 0;
+    fs->items[fs->size].word = JK_TRACE_NO_WORD;
+    fs->size++;
+}
+
+/* Calls body as the word w: the profiler finds w in its frame */
+static void call_word(jk_fiber_t *f, jk_object_t body, word_t w) {
+    size_t size = f->frames.size;
+    jk_fiber_call(f, body);
+    if (f->frames.size > size)
+        f->frames.items[size].word = w;
 }
 
-void jk_fiber_prepend(jk_fiber_t *f, jk_object_t j) {
-    f->queue = jk_make_pair(j, f->queue);
+/* Word of the frame fr, which runs its last instruction, for a quotation
+   called in tail position: the frame is popped already and the quotation
+   takes its place */
+#define TAIL_WORD(f, fr)                                                       \
+    ((fr) == &(f)->frames.items[(f)->frames.size] ? (fr)->word                 \
+                                                   : JK_TRACE_NO_WORD)
+
+static void call_builtin(jk_fiber_t *f, void (*builtin)(jk_fiber_t *),
+                         word_t tail_word) {
+    size_t size = f->frames.size;
+    builtin(f);
+    if (tail_word != JK_TRACE_NO_WORD && f->frames.size > size &&
+        f->frames.items[size].word == JK_TRACE_NO_WORD)
+        f->frames.items[size].word = tail_word;
 }
 
 void jk_push(jk_fiber_t *f, jk_object_t j) {
-    f->stack = jk_make_pair(j, f->stack);
+    jk_stack_t *s = &f->stack;
+    if (s->size >= s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : 16;
+        s->items = (jk_object_t *)realloc(s->items,
+                                          sizeof(jk_object_t) * s->capacity);
+        if (!s->items)
+            jiko_panic("jk_push: realloc failed");
+    }
+    s->items[s->size++] = j;
 }
 
 int jk_raise_error(jk_fiber_t *f, const char *str) {
@@ -39,19 +108,21 @@ int jk_raise_error(jk_fiber_t *f, const char *str) {
 }
 
 int jk_error_raised(jk_fiber_t *f) {
-    return f->stack != -1 && jk_get_type(CAR(f->stack)) == JK_ERROR;
+    return f->stack.size &&
+           jk_get_type(f->stack.items[f->stack.size - 1]) == JK_ERROR;
 }
 
 int jk_pop(jk_fiber_t *f, jk_object_t *res) {
-    if (f->stack == JK_NIL)
+    if (f->stack.size == 0)
         return jk_raise_error(f, "stack underflow");
-    assert(jk_get_type(f->stack) == JK_QUOTATION);
-    *res = CAR(f->stack);
-    jk_object_t garbage = f->stack;
-    f->stack = CDR(f->stack);
-    CAR(garbage) = JK_NIL;
-    CDR(garbage) = JK_NIL;
-    jk_object_free(garbage);
+    *res = f->stack.items[--f->stack.size];
+    return 1;
+}
+
+int jk_peek(jk_fiber_t *f, size_t n, jk_object_t *res) {
+    if (n >= f->stack.size)
+        return jk_raise_error(f, "stack underflow");
+    *res = f->stack.items[f->stack.size - 1 - n];
     return 1;
 }
 
@@ -60,24 +131,228 @@ int jk_pop(jk_fiber_t *f, jk_object_t *res) {
         jk_object_t j; \
         if (!jk_pop(f, &j)) \
             return 0; \
-        if (!(type_check)) { \
-            jk_object_free(j); \
+        if (!(type_check)) \
             return jk_raise_error(f, error_msg); \
-        } \
         *res = j; \
         return 1;\
     }
 
 MAKE_JK_POP(int, jk_get_type(j) == JK_INT, "expected integer")
+MAKE_JK_POP(integer, jk_get_type(j) == JK_INT || jk_get_type(j) == JK_BIGINT,
+            "expected integer")
 MAKE_JK_POP(bool, jk_get_type(j) == JK_BOOL, "expected boolean")
+MAKE_JK_POP(string, jk_get_type(j) == JK_STRING, "expected string")
 MAKE_JK_POP(word, jk_get_type(j) == JK_WORD, "expected word")
 MAKE_JK_POP(quotation, jk_get_type(j) == JK_QUOTATION || j == JK_NIL, "expected quotation")
 
-void jk_fiber_eval(jk_fiber_t *f, size_t limit) {
-    while (limit--) {
-        if (jk_error_raised(f))
-            return;
+/* Threaded interpreter ******************************************************/
+
+#if defined(__GNUC__) && !defined(JK_NO_COMPUTED_GOTO)
+#define JK_COMPUTED_GOTO
+#endif
+
+#define TRACE(insn)                                                            \
+    do {                                                                       \
+        JK_TRACE(f, (insn)->plain_op == JK_OP_WORD ? AS_WORD((insn)->obj)      \
+                                                   : JK_TRACE_NO_WORD);        \
+        JK_PROFILE(f);                                                         \
+    } while (0)
+
+/* Moves the innermost frame past the instruction being run. Its slot is
+   popped as soon as it is done: later calls reuse it. */
+#define ADVANCE(n)                                                             \
+    do {                                                                       \
+        fr->ip += (n);                                                         \
+        if (fr->ip == fr->code->len)                                           \
+            f->frames.size--;                                                  \
+    } while (0)
+
+/* Every handler fetches and dispatches the next instruction itself */
+#define NEXT()                                                                 \
+    do {                                                                       \
+        if (f->frames.size == 0 || *limit == 0)                                \
+            return;                                                            \
+        (*limit)--;                                                            \
+        fr = &f->frames.items[f->frames.size - 1];                             \
+        insn = &fr->code->insns[fr->ip];                                       \
+        TRACE(insn);                                                           \
+        DISPATCH(insn->op);                                                    \
+    } while (0)
+
+#define RESOLVES_TO(insn, fn)                                                  \
+    (jk_insn_resolve(f, (insn)) && (insn)->cache.builtin == (fn))
+#define TOP (f->stack.items[f->stack.size - 1])
+#define TOP_IS(type) (f->stack.size && jk_get_type(TOP) == (type))
+
+#ifdef JK_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define DISPATCH(o) goto *labels[(o)]
+#else
+#define DISPATCH(o)                                                            \
+    do {                                                                       \
+        op = (o);                                                              \
+        goto dispatch;                                                         \
+    } while (0)
+#endif
+
+/* Runs the compiled frames until none is left, the step budget is spent or
+   an error is raised */
+static void run_frames(jk_fiber_t *f, size_t *limit) {
+    jk_frame_t *fr;
+    jk_insn_t *insn;
+    jk_object_t q;
+    JK_INT_CTYPE n;
+#ifdef JK_COMPUTED_GOTO
+    static void *labels[JK_OP_COUNT] = {
+        [JK_OP_PUSH] = &&op_push,       [JK_OP_BUILTIN] = &&op_builtin,
+        [JK_OP_WORD] = &&op_word,       [JK_OP_DUP_MUL] = &&op_dup_mul,
+        [JK_OP_ADD_K] = &&op_add_k,     [JK_OP_SUB_K] = &&op_sub_k,
+        [JK_OP_EQ_K] = &&op_eq_k,       [JK_OP_IFTE] = &&op_ifte,
+    };
+#else
+    unsigned char op;
+#endif
+
+    if (f->frames.size == 0 || *limit == 0)
+        return;
+    (*limit)--;
+    fr = &f->frames.items[f->frames.size - 1];
+    insn = &fr->code->insns[fr->ip];
+    TRACE(insn);
+    DISPATCH(insn->op);
+
+#ifndef JK_COMPUTED_GOTO
+dispatch:
+    switch (op) {
+    case JK_OP_PUSH:
+        goto op_push;
+    case JK_OP_BUILTIN:
+        goto op_builtin;
+    case JK_OP_WORD:
+        goto op_word;
+    case JK_OP_DUP_MUL:
+        goto op_dup_mul;
+    case JK_OP_ADD_K:
+        goto op_add_k;
+    case JK_OP_SUB_K:
+        goto op_sub_k;
+    case JK_OP_EQ_K:
+        goto op_eq_k;
+    case JK_OP_IFTE:
+        goto op_ifte;
+    default:
+        assert(0 && "unreachable");
+        return;
+    }
+#endif
+
+op_push:
+    ADVANCE(1);
+    jk_push(f, insn->obj);
+    NEXT();
+
+op_builtin:
+    ADVANCE(1);
+    call_builtin(f, AS_BUILTIN(insn->obj), TAIL_WORD(f, fr));
+    goto after_builtin;
+
+op_word:
+    ADVANCE(1);
+    if (!jk_insn_resolve(f, insn)) {
+        jk_push(f, jk_make_error(jk_make_string("undefined word")));
+        return;
+    }
+    if (insn->cache.builtin) {
+        call_builtin(f, insn->cache.builtin, TAIL_WORD(f, fr));
+        goto after_builtin;
+    }
+    call_word(f, insn->cache.body, AS_WORD(insn->obj));
+    jk_gc_maybe();
+    NEXT();
+
+after_builtin:
+    if (jk_error_raised(f) || f->suspend)
+        return;
+    jk_gc_maybe();
+    NEXT();
+
+    /* Superinstructions fall back to the plain instruction when the words
+       they fuse were redefined or when the operands do not fit, the result
+       included: the builtin then makes a bignum */
+
+op_dup_mul:
+    if (!TOP_IS(JK_INT) || !RESOLVES_TO(insn, _dup) ||
+        !RESOLVES_TO(insn + 1, mul) ||
+        JK_MUL_OVERFLOW(AS_INT(TOP), AS_INT(TOP), &n))
+        DISPATCH(insn->plain_op);
+    ADVANCE(2);
+    TOP = jk_make_int(n);
+    NEXT();
+
+op_add_k:
+    if (!TOP_IS(JK_INT) || !RESOLVES_TO(insn + 1, add) ||
+        JK_ADD_OVERFLOW(AS_INT(TOP), AS_INT(insn->obj), &n))
+        DISPATCH(insn->plain_op);
+    ADVANCE(2);
+    TOP = jk_make_int(n);
+    NEXT();
+
+op_sub_k:
+    if (!TOP_IS(JK_INT) || !RESOLVES_TO(insn + 1, sub) ||
+        JK_SUB_OVERFLOW(AS_INT(TOP), AS_INT(insn->obj), &n))
+        DISPATCH(insn->plain_op);
+    ADVANCE(2);
+    TOP = jk_make_int(n);
+    NEXT();
+
+op_eq_k:
+    if (!TOP_IS(JK_INT) || !RESOLVES_TO(insn + 1, equal))
+        DISPATCH(insn->plain_op);
+    ADVANCE(2);
+    TOP = jk_make_bool(AS_INT(TOP) == AS_INT(insn->obj));
+    NEXT();
+
+op_ifte:
+    if (!TOP_IS(JK_BOOL) || !RESOLVES_TO(insn + 2, ifte))
+        DISPATCH(insn->plain_op);
+    q = AS_BOOL(TOP) ? insn[0].obj : insn[1].obj;
+    f->stack.size--;
+    ADVANCE(3);
+    call_word(f, q, TAIL_WORD(f, fr));
+    jk_gc_maybe();
+    NEXT();
+}
+
+#ifdef JK_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+#undef TRACE
+#undef TAIL_WORD
+#undef ADVANCE
+#undef NEXT
+#undef RESOLVES_TO
+#undef TOP
+#undef TOP_IS
+#undef DISPATCH
+
+size_t jk_fiber_eval(jk_fiber_t *f, size_t limit) {
+    f->suspend = 0;
+    if (jk_error_raised(f))
+        return limit;
+    while (limit) {
+        if (jk_error_raised(f) || f->suspend)
+            goto loop_end;
+        if (f->frames.size) {
+            run_frames(f, &limit);
+            continue;
+        }
+        jk_gc_maybe();
         jk_object_t j = jk_fiber_dequeue(f);
+        limit--;
+        JK_TRACE(f, jk_get_type(j) == JK_WORD ? AS_WORD(j) : JK_TRACE_NO_WORD);
+        JK_PROFILE(f);
         switch (jk_get_type(j)) {
         case JK_UNDEFINED:
             assert(0 && "unreachable");
@@ -90,12 +365,14 @@ void jk_fiber_eval(jk_fiber_t *f, size_t limit) {
         case JK_STRING:
         case JK_QUOTATION:
         case JK_FIBER:
+        case JK_CHANNEL:
+        case JK_BIGINT:
+        case JK_VECTOR:
         case JK_ERROR: // TODO: should we push it ??
             jk_push(f, j);
             break;
         case JK_BUILTIN:
             AS_BUILTIN(j)(f);
-            jk_object_free(j);
             break;
         case JK_WORD: {
             jk_object_t body = jk_lookup(f, AS_WORD(j));
@@ -104,20 +381,14 @@ void jk_fiber_eval(jk_fiber_t *f, size_t limit) {
                 goto loop_end;
             } else {
                 assert(jk_get_type(body) == JK_QUOTATION);
-                jk_object_t body_clone = jk_object_clone(body);
-                jk_object_t ji;
-                for (ji = body_clone; CDR(ji) != JK_NIL; ji = CDR(ji)) {
-                }
-                CDR(ji) = f->queue;
-                f->queue = body_clone;
+                call_word(f, body, AS_WORD(j));
             }
-            jk_object_free(j);
             break;
         }
         }
-        jk_fiber_print(f);
-        jk_printf("\n");
     }
 loop_end:
-    return;
-}
\ No newline at end of file
+    if (jk_error_raised(f))
+        jk_trace_error();
+    return limit;
+}
@@ -3,8 +3,13 @@
 
 void jk_fiber_enqueue(jk_fiber_t *f, jk_object_t j);
 jk_object_t jk_fiber_dequeue(jk_fiber_t *f);
-void jk_fiber_eval(jk_fiber_t *f, size_t limit);
+void jk_fiber_call(jk_fiber_t *f, jk_object_t q);
+/* Runs at most limit steps, stopping early when the fiber runs out of
+   input, raises an error or is suspended by a builtin. Returns the steps
+   left. */
+size_t jk_fiber_eval(jk_fiber_t *f, size_t limit);
 int jk_raise_error(jk_fiber_t *f, const char *str);
+int jk_error_raised(jk_fiber_t *f);
 void jk_push(jk_fiber_t *f, jk_object_t j);
 
 /* Pop with error handling
@@ -14,7 +19,12 @@ void jk_push(jk_fiber_t *f, jk_object_t j);
    result stored in *res in case of success
 */
 int jk_pop(jk_fiber_t *f, jk_object_t *res);
+/* Reads the object n levels below the top (0 is the top), same convention */
+int jk_peek(jk_fiber_t *f, size_t n, jk_object_t *res);
 int jk_pop_int(jk_fiber_t *f, jk_object_t *res);
+/* JK_INT or JK_BIGINT */
+int jk_pop_integer(jk_fiber_t *f, jk_object_t *res);
 int jk_pop_bool(jk_fiber_t *f, jk_object_t *res);
+int jk_pop_string(jk_fiber_t *f, jk_object_t *res);
 int jk_pop_word(jk_fiber_t *f, jk_object_t *res);
 int jk_pop_quotation(jk_fiber_t *f, jk_object_t *res);
\ No newline at end of file
@@ -0,0 +1,19 @@
+# Quotation-heavy input for make check: 200 lines of 100 quotations of 100
+# integers each, two million cells in all. Almost no chunk read from it
+# ends outside a quotation, yet the forms must run as they arrive, so the
+# peak of live cells stays far below that.
+BEGIN {
+    for (i = 0; i < 200; i++) {
+        printf "[";
+        for (k = 0; k < 100; k++) {
+            printf " [";
+            for (j = 0; j < 100; j++)
+                printf " %d", j;
+            printf " ]";
+        }
+        print " ] drop";
+    }
+    print "[ drop drop drop drop ] ' drop4 defn";
+    print "heap-stats call drop4 drop4 drop4 drop4 swap drop";
+    print "500000 / 0 = print";
+}
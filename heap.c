@@ -1,174 +1,466 @@
-#include "io.h"
+#include "bigint.h"
+#include "str.h"
+#include "vector.h"
+#include "chan.h"
+#include "compile.h"
+#include "env.h"
+#include "scheduler.h"
 #include "lib.h"
 #include "misc.h"
 #include "types.h"
+#include "vm.h"
 #include "word_table.h"
 #include "heap.h"
 #include <assert.h>
+#include <limits.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-struct jk_object *heap = NULL;
-static size_t heap_size = 0;
-jk_object_t free_list_head = JK_NIL;
+#include <sys/mman.h>
 
-void heap_init(size_t s) {
-    heap = (struct jk_object*)malloc(sizeof(struct jk_object) * s);
-    assert(heap);
-    heap_size = s;
-    for (size_t i = 0; i < s; i++) {
-        heap[i].type = JK_QUOTATION;
-        CAR(i) = JK_NIL;
-        CDR(i) = free_list_head;
-        free_list_head = i;
-    }
-}
+/* The heap of a VM is one virtual reservation of capacity cells, made up
+   front with mmap so that indices into its cells stay valid for the whole
+   run. Cells are committed segment by segment as the heap grows, and
+   trailing segments are handed back to the system when a collection finds
+   them empty. Cells between top and committed have never been used: they
+   are free without being on the free list, so heap_init does not have to
+   touch them.
 
-void heap_free() { free(heap); }
+   The statistics of jk_heap_stats are counted as cells are allocated and
+   typed, and the counts by type are redone from the marked cells by each
+   sweep.
 
-jk_object_t jk_object_alloc() {
-    if (free_list_head == JK_NIL)
-        jiko_panic("heap full"); // TODO: make the heap grow ?
-    jk_object_t j = free_list_head;
-    free_list_head = CDR(free_list_head);
-    return j;
+   Memory is reclaimed by a mark and sweep collector. Its roots are the
+   scope of builtins, the fibers owned by the host, the fibers held by the
+   scheduler and the roots added by the host; other spawned fibers are
+   traced through their JK_FIBER cell. Values can therefore be shared
+   freely. */
+
+#define JK_HEAP_SEGMENT_CELLS 16384
+#define JK_GC_MIN_THRESHOLD 65536
+#define JK_GC_MIN_VECTOR_THRESHOLD (64 << 20)
+
+/* Type given to cells sitting on the free list */
+#define JK_FREE_CELL JK_UNDEFINED
+
+#define IS_MARKED(h, j) ((h)->mark_bits[(size_t)(j) >> 3] & (1 << ((j)&7)))
+#define SET_MARK(h, j) ((h)->mark_bits[(size_t)(j) >> 3] |= (1 << ((j)&7)))
+
+void heap_init(size_t s) {
+    jk_heap_t *h = &jk_vm->heap;
+    s = (s + JK_HEAP_SEGMENT_CELLS - 1) / JK_HEAP_SEGMENT_CELLS *
+        JK_HEAP_SEGMENT_CELLS;
+    assert(s > 0 && s <= (size_t)INT_MAX + 1);
+    void *mem = mmap(NULL, sizeof(struct jk_object) * s, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED)
+        jiko_panic("heap_init: mmap failed");
+    h->cells = (struct jk_object *)mem;
+    h->capacity = s;
+    h->peak = h->allocated = h->freed = 0;
+    memset(h->types, 0, sizeof(h->types));
+    h->string_bytes = 0;
+    h->vector_bytes = 0;
+    h->vector_threshold = JK_GC_MIN_VECTOR_THRESHOLD;
+    h->committed = 0;
+    h->top = 0;
+    h->live = 0;
+    h->free_list = JK_NIL;
+    h->gc_threshold = JK_GC_MIN_THRESHOLD;
+    h->gc_epoch = 0;
+    h->fibers = NULL;
+    h->roots = NULL;
+    h->mark_bits = (unsigned char *)calloc(s / 8, 1);
+    assert(h->mark_bits);
+    h->mark_stack = NULL;
+    h->mark_stack_size = h->mark_stack_top = 0;
 }
 
-void jk_object_free(jk_object_t j) {
-    switch (jk_get_type(j)) {
-    case JK_UNDEFINED:
-        return; /* do nothing for special types */
-    case JK_EOF:
-        return; /* do nothing for special types */
-    case JK_NIL:
-        return; /* do nothing for special types */
-    case JK_INT:
-        break;
-    case JK_BOOL:
-        break;
+static void finalize(jk_object_t j) {
+    switch (JK_CELL(j).type) {
     case JK_STRING:
-        free((void *)AS_STRING(j));
+        jk_string_finalize(j);
+        break;
+    case JK_FIBER:
+        /* a spawned fiber dies with its self cell, the host frees its own */
+        if (!AS_FIBER(j))
+            break;
+        if (AS_FIBER(j)->boxed)
+            jk_fiber_free(AS_FIBER(j));
+        else
+            AS_FIBER(j)->self = JK_NIL;
         break;
-    case JK_WORD:
+    case JK_CHANNEL:
+        jk_chan_release(AS_CHAN(j));
         break;
-    case JK_QUOTATION:
-        jk_object_free(CAR(j));
-        jk_object_free(CDR(j));
+    case JK_BIGINT:
+        free(AS_BIGINT(j));
         break;
-    case JK_BUILTIN:
+    case JK_VECTOR:
+        jk_vm->heap.vector_bytes -= jk_vector_size(AS_VECTOR(j));
+        free(AS_VECTOR(j));
         break;
-    case JK_FIBER:
-        jk_fiber_free(AS_FIBER(j));
+    case JK_QUOTATION:
+        if (JK_CELL(j).code)
+            jk_code_release(JK_CELL(j).code);
         break;
-    case JK_ERROR:
-        jk_object_free(AS_ERROR(j));
+    default:
         break;
     }
-    jk_set_type(j, JK_QUOTATION);
-    CAR(j) = JK_NIL;
-    CDR(j) = free_list_head;
-    free_list_head = j;
 }
 
-size_t heap_free_objects_count() {
-    size_t res = 0;
-    for(jk_object_t j = free_list_head; j != JK_NIL; j = CDR(j))
-        res++;
-    return res;
+void heap_free() {
+    jk_heap_t *h = &jk_vm->heap;
+    for (size_t i = 0; i < h->top; i++)
+        finalize((jk_object_t)i);
+    while (h->fibers)
+        jk_fiber_free(h->fibers);
+    jk_code_free_all();
+    munmap(h->cells, sizeof(struct jk_object) * h->capacity);
+    free(h->mark_bits);
+    free(h->mark_stack);
+    h->cells = NULL;
+    h->mark_bits = NULL;
+    h->mark_stack = NULL;
+    h->mark_stack_size = h->mark_stack_top = 0;
+    h->capacity = h->committed = h->top = h->live = 0;
+    h->free_list = JK_NIL;
 }
 
-jk_object_t jk_object_clone(jk_object_t j) {
-    switch (jk_get_type(j)) {
-    case JK_UNDEFINED:
-    case JK_EOF:
-    case JK_NIL:
-        return j;
-    case JK_INT:
-        return jk_make_int(AS_INT(j));
-    case JK_BOOL:
-        return jk_make_bool(AS_BOOL(j));
-    case JK_STRING:
-        return jk_make_string(AS_STRING(j));
-    case JK_WORD:
-        return jk_make_word(AS_WORD(j));
-    case JK_QUOTATION: {
-        jk_object_t res = JK_NIL, ji;
-        /* TODO: do not use jk_append to have better performance */
-        for (ji = j; ji != JK_NIL; ji = CDR(ji))
-            res = jk_append(res, jk_object_clone(CAR(ji)));
-        return res;
+static void heap_grow(jk_heap_t *h) {
+    if (h->committed >= h->capacity)
+        jiko_panic("heap full");
+    if (mprotect(&h->cells[h->committed],
+                 sizeof(struct jk_object) * JK_HEAP_SEGMENT_CELLS,
+                 PROT_READ | PROT_WRITE))
+        jiko_panic("heap_grow: mprotect failed");
+    h->committed += JK_HEAP_SEGMENT_CELLS;
+}
+
+/* Gives the committed cells from boundary on back to the system */
+static void heap_shrink(jk_heap_t *h, size_t boundary) {
+    size_t bytes = sizeof(struct jk_object) * (h->committed - boundary);
+    madvise(&h->cells[boundary], bytes, MADV_DONTNEED);
+    mprotect(&h->cells[boundary], bytes, PROT_NONE);
+    h->committed = boundary;
+    if (h->top > boundary)
+        h->top = boundary;
+}
+
+jk_object_t jk_object_alloc() {
+    jk_heap_t *h = &jk_vm->heap;
+    jk_object_t j;
+    if (h->free_list != JK_NIL) {
+        j = h->free_list;
+        h->free_list = h->cells[j].value.as_pair.cdr;
+    } else {
+        if (h->top >= h->committed)
+            heap_grow(h);
+        j = (jk_object_t)h->top++;
+        h->cells[j].type = JK_FREE_CELL; /* untyped until jk_set_type */
     }
-    case JK_BUILTIN:
-        return jk_make_builtin(AS_BUILTIN(j));
-        break;
-    case JK_FIBER:
-        assert(0 && "not implemented yet");
-    case JK_ERROR:
-        return jk_make_error(jk_object_clone(AS_ERROR(j)));
-    default:
-        assert(0 && "unreachable");
+    if (++h->live > h->peak)
+        h->peak = h->live;
+    h->allocated++;
+    return j;
+}
+
+jk_object_t jk_object_alloc_block(size_t n) {
+    jk_heap_t *h = &jk_vm->heap;
+    jk_object_t j = (jk_object_t)h->top;
+    if (n > h->capacity - h->top)
+        jiko_panic("heap full");
+    while (h->top + n > h->committed)
+        heap_grow(h);
+    h->top += n;
+    h->live += n;
+    if (h->live > h->peak)
+        h->peak = h->live;
+    h->allocated += n;
+    /* the block is meant to stay: collect once the heap has doubled */
+    if (h->gc_threshold < h->live * 2)
+        h->gc_threshold = h->live * 2;
+    return j;
+}
+
+void jk_object_account(jk_object_t j) {
+    jk_heap_t *h = &jk_vm->heap;
+    assert(JK_CELL(j).type >= 0);
+    h->types[JK_CELL(j).type]++;
+    if (JK_CELL(j).type == JK_VECTOR)
+        h->vector_bytes += jk_vector_size(AS_VECTOR(j));
+}
+
+void jk_heap_stats(jk_heap_stats_t *stats) {
+    jk_heap_t *h = &jk_vm->heap;
+    stats->in_use = h->live;
+    stats->peak = h->peak;
+    stats->capacity = h->capacity;
+    stats->allocated = h->allocated;
+    stats->freed = h->freed;
+    memcpy(stats->types, h->types, sizeof(h->types));
+    stats->string_bytes = h->string_bytes;
+    stats->vector_bytes = h->vector_bytes;
+}
+
+/* Mark **********************************************************************/
+
+static void mark(jk_heap_t *h, jk_object_t j) {
+    if (j < 0 || IS_MARKED(h, j))
+        return;
+    SET_MARK(h, j);
+    if (h->mark_stack_top >= h->mark_stack_size) {
+        h->mark_stack_size = h->mark_stack_size ? h->mark_stack_size * 2 : 1024;
+        h->mark_stack = (jk_object_t *)realloc(
+            h->mark_stack, sizeof(jk_object_t) * h->mark_stack_size);
+        if (!h->mark_stack)
+            jiko_panic("mark: realloc failed");
     }
+    h->mark_stack[h->mark_stack_top++] = j;
+}
+
+static void mark_value(void *h, jk_object_t j) { mark((jk_heap_t *)h, j); }
+
+static void mark_env(jk_heap_t *h, jk_env_t *env) {
+    for (; env; env = env->parent)
+        for (size_t i = 0; i < env->count; i++)
+            mark(h, env->entries[i].body);
+}
+
+static void mark_fiber(jk_heap_t *h, jk_fiber_t *f) {
+    if (f->gc_epoch == h->gc_epoch)
+        return;
+    f->gc_epoch = h->gc_epoch;
+    mark(h, f->self);
+    for (size_t i = 0; i < f->stack.size; i++)
+        mark(h, f->stack.items[i]);
+    for (size_t i = 0; i < f->frames.size; i++)
+        mark(h, f->frames.items[i].code->quotation);
+    mark(h, f->queue);
+    mark_env(h, f->env);
+}
+
+/* Children are pushed on an explicit stack, so that long lists do not
+   exhaust the C stack */
+static void mark_children(jk_heap_t *h) {
+    while (h->mark_stack_top) {
+        jk_object_t j = h->mark_stack[--h->mark_stack_top];
+        switch (h->cells[j].type) {
+        case JK_QUOTATION:
+            mark(h, CAR(j));
+            mark(h, CDR(j));
+            break;
+        case JK_FIBER:
+            if (AS_FIBER(j))
+                mark_fiber(h, AS_FIBER(j));
+            break;
+        case JK_ERROR:
+            mark(h, AS_ERROR(j));
+            break;
+        case JK_CHANNEL:
+            jk_chan_mark(AS_CHAN(j), mark_value, h);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/* Sweep *********************************************************************/
+
+/* Rebuilds the free list in address order, segment by segment from the top,
+   and returns the end of the last segment holding a live cell. Free cells of
+   the empty trailing segments are left out of the list. */
+static size_t sweep(jk_heap_t *h) {
+    size_t boundary = 0, swept = h->live;
+    h->free_list = JK_NIL;
+    h->live = 0;
+    memset(h->types, 0, sizeof(h->types));
+    for (size_t seg = h->committed / JK_HEAP_SEGMENT_CELLS; seg-- > 0;) {
+        size_t start = seg * JK_HEAP_SEGMENT_CELLS;
+        size_t end = start + JK_HEAP_SEGMENT_CELLS;
+        size_t live = 0;
+        jk_object_t saved_head = h->free_list;
+        if (end > h->top)
+            end = h->top;
+        for (size_t i = end; i-- > start;) {
+            jk_object_t j = (jk_object_t)i;
+            if (IS_MARKED(h, j)) {
+                live++;
+                h->types[h->cells[j].type]++;
+                continue;
+            }
+            if (h->cells[j].type != JK_FREE_CELL) {
+                finalize(j);
+                h->cells[j].type = JK_FREE_CELL;
+            }
+            CDR(j) = h->free_list;
+            h->free_list = j;
+        }
+        if (live == 0 && boundary == 0)
+            h->free_list = saved_head;
+        else if (boundary == 0)
+            boundary = start + JK_HEAP_SEGMENT_CELLS;
+        h->live += live;
+        memset(&h->mark_bits[start / 8], 0, JK_HEAP_SEGMENT_CELLS / 8);
+    }
+    h->freed += swept - h->live;
+    return boundary;
+}
+
+void jk_gc_collect() {
+    jk_heap_t *h = &jk_vm->heap;
+    h->gc_epoch++;
+    /* fibers are roots while the host or the scheduler holds them */
+    for (jk_fiber_t *f = h->fibers; f; f = f->gc_next)
+        if (!f->boxed || f->state != JK_FIBER_IDLE)
+            mark_fiber(h, f);
+    for (jk_gc_root_t *r = h->roots; r; r = r->next)
+        r->mark(r->data, mark_value, h);
+    mark_env(h, jk_vm->builtins);
+    mark_children(h);
+
+    size_t boundary = sweep(h);
+    h->gc_threshold = h->live * 2;
+    if (h->gc_threshold < JK_GC_MIN_THRESHOLD)
+        h->gc_threshold = JK_GC_MIN_THRESHOLD;
+    h->vector_threshold = h->vector_bytes * 2;
+    if (h->vector_threshold < JK_GC_MIN_VECTOR_THRESHOLD)
+        h->vector_threshold = JK_GC_MIN_VECTOR_THRESHOLD;
+
+    /* keep enough committed memory to reach the next threshold */
+    size_t keep = (h->gc_threshold + JK_HEAP_SEGMENT_CELLS - 1) /
+                  JK_HEAP_SEGMENT_CELLS * JK_HEAP_SEGMENT_CELLS;
+    if (keep < boundary)
+        keep = boundary;
+    if (keep < h->committed)
+        heap_shrink(h, keep);
+    if (h->top > boundary)
+        h->top = boundary;
+}
+
+void jk_gc_maybe() {
+    if (jk_vm->heap.live >= jk_vm->heap.gc_threshold ||
+        jk_vm->heap.vector_bytes >= jk_vm->heap.vector_threshold)
+        jk_gc_collect();
+}
+
+void jk_gc_add_root(jk_gc_root_t *r) {
+    jk_heap_t *h = &jk_vm->heap;
+    r->next = h->roots;
+    r->prev = NULL;
+    if (h->roots)
+        h->roots->prev = r;
+    h->roots = r;
+}
+
+void jk_gc_remove_root(jk_gc_root_t *r) {
+    if (r->prev)
+        r->prev->next = r->next;
+    else
+        jk_vm->heap.roots = r->next;
+    if (r->next)
+        r->next->prev = r->prev;
 }
 
 void jk_set_type(jk_object_t j, jk_type t) {
-    if (j >= 0)
-        heap[j].type = t;
+    if (j >= 0) {
+        size_t *types = jk_vm->heap.types;
+        if (JK_CELL(j).type >= 0)
+            types[JK_CELL(j).type]--;
+        if (t >= 0)
+            types[t]++;
+        JK_CELL(j).type = t;
+    }
     /* else do nothing (special types that have only one value)*/
 }
 
-jk_fiber_t *jk_fiber_new() {
+static jk_fiber_t *fiber_alloc(struct jk_env *env) {
+    jk_heap_t *h = &jk_vm->heap;
     jk_fiber_t *res = (jk_fiber_t*)malloc(sizeof(jk_fiber_t));
-    res->stack = JK_NIL;
-    res->queue = JK_NIL;
-    res->env_stack = jk_make_pair(JK_NIL, JK_NIL);
-    register_lib(res, stdlib_builtins);
+    assert(res);
+    res->gc_next = h->fibers;
+    res->gc_prev = NULL;
+    if (h->fibers)
+        h->fibers->gc_prev = res;
+    res->gc_epoch = h->gc_epoch;
+    res->boxed = 0;
+    h->fibers = res;
+    res->stack.items = NULL;
+    res->stack.size = res->stack.capacity = 0;
+    res->frames.items = NULL;
+    res->frames.size = res->frames.capacity = 0;
+    res->queue = res->queue_tail = JK_NIL;
+    res->env = env;
+    res->self = JK_NIL;
+    res->state = JK_FIBER_IDLE;
+    res->suspend = 0;
+    res->sched_next = res->joining = NULL;
+    res->waiting = NULL;
+    res->joiners.head = res->joiners.tail = NULL;
     return res;
 }
 
+jk_fiber_t *jk_fiber_new() {
+    return fiber_alloc(jk_env_new(jk_vm->builtins));
+}
+
+jk_fiber_t *jk_fiber_spawn(jk_fiber_t *parent) {
+    jk_fiber_t *res = fiber_alloc(jk_env_new(parent->env));
+    res->boxed = 1;
+    jk_make_fiber(res);
+    return res;
+}
+
+/* The objects of the fiber are reclaimed by the next collection */
 void jk_fiber_free(jk_fiber_t *f) {
-    jk_object_free(f->stack);
-    jk_object_free(f->queue);
-    jk_object_free(f->env_stack);
+    jk_sched_remove(f);
+    if (f->gc_prev)
+        f->gc_prev->gc_next = f->gc_next;
+    else
+        jk_vm->heap.fibers = f->gc_next;
+    if (f->gc_next)
+        f->gc_next->gc_prev = f->gc_prev;
+    if (f->self != JK_NIL)
+        AS_FIBER(f->self) = NULL; /* the cell may outlive a host fiber */
+    free(f->stack.items);
+    free(f->frames.items);
+    jk_env_release(f->env);
     free(f);
 }
 
 jk_type jk_get_type(jk_object_t j) {
     if (j >= 0)
-        return heap[j].type;
-    else
+        return JK_CELL(j).type;
+    else if (JK_IS_IMM_INT(j))
+        return JK_INT;
+    else if (JK_IS_IMM_WORD(j))
+        return JK_WORD;
+    else if (j >= JK_UNDEFINED)
         return (jk_type)j;
+    else
+        return JK_BOOL;
 }
 
 /* Constructors **************************************************************/
 
+/* Integers that do not fit in an immediate are boxed in a heap cell */
 jk_object_t jk_make_int(JK_INT_CTYPE i) {
+    if (i >= JK_IMM_INT_MIN && i <= JK_IMM_INT_MAX)
+        return JK_IMM_INT(i);
     jk_object_t res = jk_object_alloc();
     jk_set_type(res, JK_INT);
-    AS_INT(res) = i;
+    JK_CELL(res).value.as_int = i;
     return res;
 }
 
-jk_object_t jk_make_bool(int b) {
-    jk_object_t res = jk_object_alloc();
-    jk_set_type(res, JK_BOOL);
-    AS_BOOL(res) = b;
-    return res;
-}
-
-jk_object_t jk_make_string(const char *str) {
-    jk_object_t res = jk_object_alloc();
-    jk_set_type(res, JK_STRING);
-    AS_STRING(res) = strdup(str);
-    return res;
-}
+jk_object_t jk_make_bool(int b) { return b ? JK_TRUE : JK_FALSE; }
 
 jk_object_t jk_make_word(word_t w) {
-    jk_object_t res = jk_object_alloc();
-    jk_set_type(res, JK_WORD);
-    AS_WORD(res) = w;
-    return res;
+    if (w > JK_IMM_WORD_MAX)
+        jiko_panic("too many words");
+    return JK_IMM_WORD(w);
 }
 
 jk_object_t jk_make_word_from_string(const char *w) {
@@ -178,6 +470,7 @@ jk_object_t jk_make_word_from_string(const char *w) {
 jk_object_t jk_make_pair(jk_object_t car, jk_object_t cdr) {
     jk_object_t res = jk_object_alloc();
     jk_set_type(res, JK_QUOTATION);
+    JK_CELL(res).code = 0;
     CAR(res) = car;
     CDR(res) = cdr;
     return res;
@@ -204,9 +497,12 @@ jk_object_t jk_make_builtin(void (*f)(jk_fiber_t *)) {
 }
 
 jk_object_t jk_make_fiber(jk_fiber_t *f) {
+    if (f->self != JK_NIL)
+        return f->self;
     jk_object_t res = jk_object_alloc();
     jk_set_type(res, JK_FIBER);
     AS_FIBER(res) = f;
+    f->self = res;
     return res;
 }
 
@@ -216,139 +512,3 @@ jk_object_t jk_make_error(jk_object_t j) {
     AS_ERROR(res) = j;
     return res;
 }
-
-#define MAYBE_GROW()                                                           \
-    do {                                                                       \
-        if (o >= mem_amount) {                                                 \
-            mem_amount += len;                                                 \
-            res = (char*)realloc(res, mem_amount);                                    \
-            if (!res)                                                          \
-                return NULL;                                                   \
-        }                                                                      \
-    } while (0)
-
-char *jk_escape_string(const char *str) {
-    const size_t len = strlen(str);
-    size_t mem_amount = len < 2 ? 2 : len;
-    char *res = (char*)malloc(mem_amount); /* will grow later */
-    size_t o = 0;
-    res[o++] = '"';
-    MAYBE_GROW();
-    for (size_t i = 0; i < len; i++) {
-        MAYBE_GROW();
-        switch (str[i]) {
-        case '\n':
-            res[o++] = '\\';
-            res[o++] = 'n';
-            break;
-        case '\r':
-            res[o++] = '\\';
-            res[o++] = 'r';
-            break;
-        case '\t':
-            res[o++] = '\\';
-            res[o++] = 't';
-            break;
-        case '"':
-            res[o++] = '\\';
-            res[o++] = '"';
-            break;
-        case '\\':
-            res[o++] = '\\';
-            res[o++] = '\\';
-            break;
-        default:
-            res[o++] = str[i];
-        }
-    }
-    MAYBE_GROW();
-    res[o++] = '"';
-    res[o++] = 0;
-    res = (char*)realloc(res, o);
-    assert(res);
-    return res;
-}
-
-#undef MAYBE_GROW
-
-// TODO: transform it to a jk_to_string function ?
-void jk_print_object(jk_object_t j) {
-    switch (jk_get_type(j)) {
-    case JK_UNDEFINED:
-        assert(0 && "unreachable");
-        jk_printf("<undefined>");
-        break;
-    case JK_INT:
-        jk_printf(JK_INT_CTYPE_FORMAT, AS_INT(j));
-        break;
-    case JK_BOOL:
-        jk_printf("%s", AS_BOOL(j) ? "true" : "false");
-        break;
-    case JK_STRING: {
-        char *escaped = jk_escape_string(AS_STRING(j));
-        jk_printf("%s", escaped);
-        free(escaped);
-        break;
-    }
-    case JK_WORD:
-        jk_printf("%s", word_to_string(AS_WORD(j)));
-        break;
-    case JK_NIL:
-        jk_printf("[]");
-        break;
-    case JK_QUOTATION: {
-        jk_printf("[");
-        for (jk_object_t ji = j; ji != JK_NIL; ji = CDR(ji)) {
-            jk_print_object(CAR(ji));
-            if (CDR(ji) != JK_NIL)
-                jk_printf(" ");
-        }
-        jk_printf("]");
-        break;
-    }
-    case JK_BUILTIN:
-        jk_printf("<builtin 0x%lx>", (intptr_t)AS_BUILTIN(j));
-        break;
-    case JK_FIBER:
-        jk_printf("<fiber 0x%lx>", (intptr_t)AS_FIBER(j));
-        break;
-    case JK_ERROR:
-        jk_printf("<error ");
-        jk_print_object(AS_ERROR(j));
-        jk_printf(">");
-        break;
-    case JK_EOF:
-        break;
-    }
-}
-
-static jk_object_t prev(jk_object_t head, jk_object_t j) {
-    assert(head != JK_NIL);
-    assert(head != j);
-    jk_object_t res;
-    for (res = head; CDR(res) != j; res = CDR(res)) {
-        assert(res != JK_NIL);
-    }
-    return res;
-}
-
-static void print_reversed(jk_object_t j) {
-    assert(jk_get_type(j) == JK_QUOTATION || j == JK_NIL);
-    if (j == JK_NIL)
-        jk_printf("[]");
-    else {
-        jk_printf("[");
-        for (jk_object_t ji = prev(j, JK_NIL); ji != j; ji = prev(j, ji)) {
-            jk_print_object(CAR(ji));
-            jk_printf(" ");
-        }
-        jk_print_object(CAR(j));
-        jk_printf("]");
-    }
-}
-
-void jk_fiber_print(jk_fiber_t *f) {
-    print_reversed(f->stack);
-    jk_printf(" : ");
-    jk_print_object(f->queue);
-}
\ No newline at end of file
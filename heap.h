@@ -3,13 +3,75 @@
 
 #include "types.h"
 
-extern struct jk_object *heap;
+/* Number of types a heap cell can have: JK_INT to JK_VECTOR */
+#define JK_HEAP_TYPES (JK_VECTOR + 1)
 
+/* A root besides the fibers, such as the quotations a parser has left
+   open: mark(data, mark_value, ctx) calls mark_value(ctx, j) on each object
+   it holds. */
+typedef struct jk_gc_root {
+    void (*mark)(void *data, void (*mark_value)(void *, jk_object_t),
+                 void *ctx);
+    void *data;
+    struct jk_gc_root *next, *prev;
+} jk_gc_root_t;
+
+/* Heap of a VM, see heap.c */
+typedef struct jk_heap {
+    struct jk_object *cells;
+    size_t capacity;  /* reserved cells */
+    size_t committed; /* committed cells (whole segments) */
+    size_t top;       /* first never-used cell */
+    size_t live;      /* live or garbage, until the next sweep */
+    size_t peak;      /* highest value of live since heap_init */
+    size_t allocated; /* cells allocated since heap_init */
+    size_t freed;     /* cells reclaimed since heap_init */
+    size_t types[JK_HEAP_TYPES]; /* live or garbage cells by type */
+    size_t string_bytes;         /* held by strings out of their cells */
+    size_t vector_bytes;         /* held by the vectors of JK_VECTOR cells */
+    size_t vector_threshold;     /* vector_bytes that trigger a collection */
+    unsigned char *mark_bits;
+    jk_object_t free_list;
+    size_t gc_threshold;
+    unsigned int gc_epoch;
+    jk_fiber_t *fibers; /* every fiber, boxed or not */
+    jk_gc_root_t *roots;
+    jk_object_t *mark_stack;
+    size_t mark_stack_size, mark_stack_top;
+} jk_heap_t;
+
+/* Sets up the heap of the current VM */
 void heap_init(size_t s);
 void heap_free();
+
 jk_object_t jk_object_alloc();
-void jk_object_free(jk_object_t j);
-size_t heap_free_objects_count();
-jk_object_t jk_object_clone(jk_object_t j);
+/* Allocates n consecutive cells at the top of the heap, returns the first.
+   The caller fills them in place, then reports each one with
+   jk_object_account so that the statistics count its type. */
+jk_object_t jk_object_alloc_block(size_t n);
+void jk_object_account(jk_object_t j);
+
+/* Counters of the heap, kept up to date as cells come and go: reading them
+   costs the same whatever the size of the heap. Like live, in_use and
+   types include the garbage not swept yet. */
+typedef struct jk_heap_stats {
+    size_t in_use, peak, capacity;
+    size_t allocated, freed;
+    size_t types[JK_HEAP_TYPES];
+    size_t string_bytes, vector_bytes;
+} jk_heap_stats_t;
+
+void jk_heap_stats(jk_heap_stats_t *stats);
+
+/* Mark and sweep garbage collection. Allocation never collects: the heap
+   grows instead, and the evaluator calls jk_gc_maybe() between steps, when
+   every live object is reachable from a fiber or a root. It collects once
+   the cells or the bytes held by vectors have doubled since the last
+   collection. */
+void jk_gc_collect();
+void jk_gc_maybe();
+/* r is marked by every collection of the current VM until it is removed */
+void jk_gc_add_root(jk_gc_root_t *r);
+void jk_gc_remove_root(jk_gc_root_t *r);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,466 @@
+#include "image.h"
+#include "bigint.h"
+#include "str.h"
+#include "vector.h"
+#include "env.h"
+#include "heap.h"
+#include "lib.h"
+#include "misc.h"
+#include "vm.h"
+#include "word_table.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Image file, in the byte order of the host:
+
+     header
+     words    image_word_t[words]       strings of the words, in word order
+     cells    struct jk_object[cells]   at an 8-byte aligned offset
+     defs     image_def_t[defs]         in definition order
+     strings  char[strings_size]        NUL terminated strings
+
+   Cells are renumbered from 0 in breadth-first order from the bodies of
+   the definitions, and keep their layout in the heap. A string cell holds
+   the offset of its characters in strings (as_int), a bignum cell the
+   offset of its decimal digits, a vector cell the offset of its items in
+   decimal separated by spaces, a builtin cell its index in
+   stdlib_builtins (as_int). Words are immediates: interning the
+   words in order in the empty table of a new VM gives them back their
+   numbers.
+
+   Loading maps the file and checks every index before copying the cells
+   in one block, so a truncated image or one from another build is
+   rejected instead of corrupting the heap. */
+
+#define IMAGE_MAGIC "jikoimg1"
+
+typedef struct image_header {
+    char magic[8];
+    uint32_t cell_size; /* sizeof(struct jk_object) of the build */
+    uint32_t builtins;  /* entries of stdlib_builtins */
+    uint32_t words, cells, defs, strings_size;
+} image_header_t;
+
+typedef struct image_word {
+    uint32_t offset, len;
+} image_word_t;
+
+typedef struct image_def {
+    int32_t word, body;
+} image_def_t;
+
+typedef struct image_layout {
+    size_t words, cells, defs, strings, size; /* offsets in the file */
+} image_layout_t;
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+static void image_layout(const image_header_t *hd, image_layout_t *l) {
+    l->words = ALIGN8(sizeof(image_header_t));
+    l->cells = ALIGN8(l->words + sizeof(image_word_t) * hd->words);
+    l->defs = l->cells + (size_t)hd->cell_size * hd->cells;
+    l->strings = l->defs + sizeof(image_def_t) * hd->defs;
+    l->size = l->strings + hd->strings_size;
+}
+
+static uint32_t builtins_count() {
+    uint32_t n = 0;
+    while (stdlib_builtins[n].name)
+        n++;
+    return n;
+}
+
+/* Dump **********************************************************************/
+
+typedef struct dumper {
+    jk_object_t *index;       /* 1 + image index of each heap cell, or 0 */
+    jk_object_t *order;       /* heap cells in image order */
+    struct jk_object *cells;  /* image cells */
+    size_t count, capacity;
+    char *strings;
+    size_t strings_size, strings_capacity;
+    const char *error;
+} dumper_t;
+
+static uint32_t add_string(dumper_t *d, const char *str, size_t len) {
+    size_t offset = d->strings_size;
+    if (d->strings_size + len + 1 > d->strings_capacity) {
+        while (d->strings_size + len + 1 > d->strings_capacity)
+            d->strings_capacity =
+                d->strings_capacity ? d->strings_capacity * 2 : 4096;
+        d->strings = (char *)realloc(d->strings, d->strings_capacity);
+        if (!d->strings)
+            jiko_panic("jk_image_dump: realloc failed");
+    }
+    memcpy(d->strings + offset, str, len);
+    d->strings[offset + len] = 0;
+    d->strings_size += len + 1;
+    return (uint32_t)offset;
+}
+
+/* Image index of j, which is queued the first time it is seen */
+static jk_object_t renumber(dumper_t *d, jk_object_t j) {
+    if (JK_IS_IMMEDIATE(j))
+        return j;
+    if (d->index[j])
+        return d->index[j] - 1;
+    if (d->count >= d->capacity) {
+        d->capacity = d->capacity ? d->capacity * 2 : 1024;
+        d->order = (jk_object_t *)realloc(d->order,
+                                          sizeof(jk_object_t) * d->capacity);
+        d->cells = (struct jk_object *)realloc(
+            d->cells, sizeof(struct jk_object) * d->capacity);
+        if (!d->order || !d->cells)
+            jiko_panic("jk_image_dump: realloc failed");
+    }
+    d->order[d->count] = j;
+    d->index[j] = (jk_object_t)++d->count;
+    return d->index[j] - 1;
+}
+
+static int builtin_index(void (*fn)(jk_fiber_t *)) {
+    for (int i = 0; stdlib_builtins[i].name; i++)
+        if (stdlib_builtins[i].builtin == fn)
+            return i;
+    return -1;
+}
+
+/* Fills the image cell i from the heap cell it stands for */
+static void dump_cell(dumper_t *d, size_t i) {
+    jk_object_t j = d->order[i];
+    struct jk_object cell, *c = &cell; /* renumber may move d->cells */
+    memset(c, 0, sizeof(*c));
+    c->type = JK_CELL(j).type;
+    switch (c->type) {
+    case JK_INT:
+        c->value.as_int = AS_INT(j);
+        break;
+    case JK_STRING:
+        c->value.as_int =
+            add_string(d, jk_string_chars(j), jk_string_length(j));
+        break;
+    case JK_BIGINT: {
+        char *digits = jk_bigint_to_string(AS_BIGINT(j));
+        c->value.as_int = add_string(d, digits, strlen(digits));
+        free(digits);
+        break;
+    }
+    case JK_VECTOR: {
+        char *items = jk_vector_to_string(AS_VECTOR(j));
+        c->value.as_int = add_string(d, items, strlen(items));
+        free(items);
+        break;
+    }
+    case JK_QUOTATION:
+        c->value.as_pair.car = renumber(d, CAR(j));
+        c->value.as_pair.cdr = renumber(d, CDR(j));
+        break;
+    case JK_BUILTIN:
+        c->value.as_int = builtin_index(AS_BUILTIN(j));
+        if (c->value.as_int < 0)
+            d->error = "builtin outside of the standard library";
+        break;
+    case JK_ERROR:
+        c->value.as_error = renumber(d, AS_ERROR(j));
+        break;
+    case JK_FIBER:
+    case JK_CHANNEL:
+        d->error = "fibers and channels cannot be dumped";
+        break;
+    default:
+        d->error = "unexpected cell";
+        break;
+    }
+    d->cells[i] = cell;
+}
+
+/* Writes n bytes at data, then zeros up to offset end */
+static int write_section(FILE *out, const void *data, size_t n, size_t end) {
+    static const char zeros[8];
+    long pos = ftell(out);
+    if (n && fwrite(data, n, 1, out) != 1)
+        return 0;
+    return pos >= 0 && (size_t)pos + n <= end &&
+           fwrite(zeros, 1, end - pos - n, out) == end - pos - n;
+}
+
+static int write_image(FILE *out, const image_header_t *hd, dumper_t *d,
+                       image_word_t *words, image_def_t *defs) {
+    image_layout_t l;
+    image_layout(hd, &l);
+    return write_section(out, hd, sizeof(*hd), l.words) &&
+           write_section(out, words, sizeof(image_word_t) * hd->words,
+                         l.cells) &&
+           write_section(out, d->cells, sizeof(struct jk_object) * hd->cells,
+                         l.defs) &&
+           write_section(out, defs, sizeof(image_def_t) * hd->defs,
+                         l.strings) &&
+           write_section(out, d->strings, hd->strings_size, l.size);
+}
+
+const char *jk_image_dump(jk_fiber_t *f, const char *path) {
+    jk_heap_t *h = &jk_vm->heap;
+    dumper_t d;
+    image_header_t hd;
+    image_word_t *words;
+    image_def_t *defs;
+    jk_env_t *scopes[64];
+    size_t depth = 0, ndefs = 0;
+
+    memset(&d, 0, sizeof(d));
+    d.index = (jk_object_t *)calloc(h->top + 1, sizeof(jk_object_t));
+    if (!d.index)
+        jiko_panic("jk_image_dump: calloc failed");
+
+    /* outer scopes first, so that inner definitions win when loading */
+    for (jk_env_t *env = f->env; env; env = env->parent) {
+        if (depth == sizeof(scopes) / sizeof(*scopes)) {
+            free(d.index);
+            return "too many nested scopes";
+        }
+        scopes[depth++] = env;
+        ndefs += env->count;
+    }
+    defs = (image_def_t *)malloc(sizeof(image_def_t) * (ndefs + 1));
+    if (!defs)
+        jiko_panic("jk_image_dump: malloc failed");
+    ndefs = 0;
+    while (depth--)
+        for (size_t i = 0; i < scopes[depth]->count; i++) {
+            defs[ndefs].word = (int32_t)scopes[depth]->entries[i].word;
+            defs[ndefs].body = renumber(&d, scopes[depth]->entries[i].body);
+            ndefs++;
+        }
+    for (size_t i = 0; i < d.count && !d.error; i++)
+        dump_cell(&d, i);
+
+    memset(&hd, 0, sizeof(hd));
+    memcpy(hd.magic, IMAGE_MAGIC, sizeof(hd.magic));
+    hd.cell_size = sizeof(struct jk_object);
+    hd.builtins = builtins_count();
+    hd.words = (uint32_t)jk_vm->words.count;
+    hd.cells = (uint32_t)d.count;
+    hd.defs = (uint32_t)ndefs;
+    words = (image_word_t *)malloc(sizeof(image_word_t) * (hd.words + 1));
+    if (!words)
+        jiko_panic("jk_image_dump: malloc failed");
+    for (uint32_t w = 0; w < hd.words; w++) {
+        const char *str = word_to_string(w);
+        words[w].len = (uint32_t)strlen(str);
+        words[w].offset = add_string(&d, str, words[w].len);
+    }
+    hd.strings_size = (uint32_t)d.strings_size;
+
+    if (!d.error) {
+        FILE *out = fopen(path, "wb");
+        if (!out) {
+            d.error = "cannot open the image for writing";
+        } else {
+            int ok = write_image(out, &hd, &d, words, defs);
+            if (fclose(out) != 0 || !ok)
+                d.error = "cannot write the image";
+        }
+    }
+    free(words);
+    free(defs);
+    free(d.index);
+    free(d.order);
+    free(d.cells);
+    free(d.strings);
+    return d.error;
+}
+
+/* Load **********************************************************************/
+
+typedef struct image {
+    const image_header_t *hd;
+    const struct jk_object *cells;
+    const char *strings;
+} image_t;
+
+/* Valid reference from a cell of the image */
+static int valid_ref(const image_t *im, int32_t j) {
+    if (j >= 0)
+        return (uint32_t)j < im->hd->cells;
+    if (JK_IS_IMM_WORD(j))
+        return AS_WORD(j) < im->hd->words;
+    return JK_IS_IMM_INT(j) || j == JK_NIL || j == JK_TRUE || j == JK_FALSE;
+}
+
+static int valid_list(const image_t *im, int32_t j) {
+    return j == JK_NIL ||
+           (j >= 0 && (uint32_t)j < im->hd->cells &&
+            im->cells[j].type == JK_QUOTATION);
+}
+
+/* Decimal digits after an optional '-', up to the NUL */
+static int valid_digits(const char *str) {
+    str += *str == '-';
+    if (!*str)
+        return 0;
+    for (; *str; str++)
+        if (*str < '0' || *str > '9')
+            return 0;
+    return 1;
+}
+
+/* Items of a vector, parsed once here so that loading cannot fail */
+static int valid_items(const char *str) {
+    jk_vector_t *v = jk_vector_from_string(str);
+    if (!v)
+        return 0;
+    free(v);
+    return 1;
+}
+
+static int valid_cell(const image_t *im, const struct jk_object *c) {
+    switch (c->type) {
+    case JK_INT:
+        return 1;
+    case JK_BIGINT:
+        return c->value.as_int >= 0 &&
+               (unsigned long)c->value.as_int < im->hd->strings_size &&
+               valid_digits(im->strings + c->value.as_int);
+    case JK_VECTOR:
+        return c->value.as_int >= 0 &&
+               (unsigned long)c->value.as_int < im->hd->strings_size &&
+               valid_items(im->strings + c->value.as_int);
+    case JK_STRING:
+        return c->value.as_int >= 0 &&
+               (unsigned long)c->value.as_int < im->hd->strings_size;
+    case JK_QUOTATION:
+        return valid_ref(im, c->value.as_pair.car) &&
+               valid_list(im, c->value.as_pair.cdr);
+    case JK_BUILTIN:
+        return c->value.as_int >= 0 &&
+               (unsigned long)c->value.as_int < im->hd->builtins;
+    case JK_ERROR:
+        return valid_ref(im, c->value.as_error);
+    default:
+        return 0;
+    }
+}
+
+/* Checks the whole image, so that loading it cannot fail halfway */
+static const char *check_image(const image_t *im, size_t size) {
+    const image_header_t *hd = im->hd;
+    image_layout_t l;
+    if (size < sizeof(*hd) ||
+        memcmp(hd->magic, IMAGE_MAGIC, sizeof(hd->magic)) != 0)
+        return "not a jiko image";
+    if (hd->cell_size != sizeof(struct jk_object) ||
+        hd->builtins != builtins_count())
+        return "image written by another build";
+    image_layout(hd, &l);
+    if (l.size != size)
+        return "truncated image";
+    if (hd->strings_size && im->strings[hd->strings_size - 1] != 0)
+        return "corrupted image";
+    const image_word_t *words =
+        (const image_word_t *)((const char *)hd + l.words);
+    for (uint32_t w = 0; w < hd->words; w++)
+        if (words[w].offset >= hd->strings_size ||
+            words[w].len >= hd->strings_size - words[w].offset)
+            return "corrupted image";
+    for (uint32_t i = 0; i < hd->cells; i++)
+        if (!valid_cell(im, &im->cells[i]))
+            return "corrupted image";
+    const image_def_t *defs = (const image_def_t *)((const char *)hd + l.defs);
+    for (uint32_t i = 0; i < hd->defs; i++)
+        if (defs[i].word < 0 || (uint32_t)defs[i].word >= hd->words ||
+            !valid_list(im, defs[i].body) || defs[i].body == JK_NIL)
+            return "corrupted image";
+    return NULL;
+}
+
+/* Fills the current VM, which is empty */
+static const char *load_image(const image_t *im) {
+    const image_header_t *hd = im->hd;
+    image_layout_t l;
+    image_layout(hd, &l);
+    const image_word_t *words =
+        (const image_word_t *)((const char *)hd + l.words);
+    const image_def_t *defs = (const image_def_t *)((const char *)hd + l.defs);
+
+    for (uint32_t w = 0; w < hd->words; w++)
+        if (word_from_chars(im->strings + words[w].offset, words[w].len) != w)
+            return "corrupted image"; /* duplicate word */
+    if (hd->cells > jk_vm->heap.capacity)
+        return "heap too small for the image";
+    if (hd->cells) {
+        jk_object_t base = jk_object_alloc_block(hd->cells);
+        struct jk_object *cells = &JK_CELL(base);
+        assert(base == 0);
+        memcpy(cells, im->cells, sizeof(struct jk_object) * hd->cells);
+        for (uint32_t i = 0; i < hd->cells; i++) {
+            struct jk_object *c = &cells[i];
+            c->code = 0;
+            if (c->type == JK_STRING)
+                jk_string_init(base + (jk_object_t)i,
+                               im->strings + c->value.as_int,
+                               strlen(im->strings + c->value.as_int));
+            else if (c->type == JK_BIGINT)
+                c->value.as_bigint = jk_bigint_from_chars(
+                    im->strings + c->value.as_int,
+                    strlen(im->strings + c->value.as_int));
+            else if (c->type == JK_VECTOR)
+                c->value.as_vector =
+                    jk_vector_from_string(im->strings + c->value.as_int);
+            else if (c->type == JK_BUILTIN)
+                c->value.as_builtin = stdlib_builtins[c->value.as_int].builtin;
+            jk_object_account(base + (jk_object_t)i);
+        }
+    }
+    for (uint32_t i = 0; i < hd->defs; i++)
+        jk_env_define(jk_vm->builtins, (word_t)defs[i].word, defs[i].body);
+    return NULL;
+}
+
+jk_vm_t *jk_image_load(const char *path, size_t heap_cells, size_t words,
+                       const char **error) {
+    struct stat st;
+    void *mem = MAP_FAILED;
+    int fd = open(path, O_RDONLY);
+    jk_vm_t *vm = NULL;
+    image_t im;
+    image_layout_t l;
+
+    *error = "cannot read the image";
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        mem = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    im.hd = (const image_header_t *)mem;
+    *error = "not a jiko image";
+    if ((size_t)st.st_size >= sizeof(image_header_t)) {
+        image_layout(im.hd, &l);
+        im.cells = (const struct jk_object *)((const char *)mem + l.cells);
+        im.strings = (const char *)mem + l.strings;
+        *error = check_image(&im, (size_t)st.st_size);
+    }
+    if (!*error) {
+        vm = jk_vm_new_empty(heap_cells, words);
+        jk_vm_t *prev = jk_vm_enter(vm);
+        *error = load_image(&im);
+        jk_vm_enter(prev);
+        if (*error) {
+            jk_vm_free(vm);
+            vm = NULL;
+        }
+    }
+    munmap(mem, (size_t)st.st_size);
+    return vm;
+}
+
+#undef ALIGN8
@@ -0,0 +1,25 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "types.h"
+#include "vm.h"
+#include <stddef.h>
+
+/* A VM image holds the definitions seen by a fiber, the heap cells their
+   bodies use and the word table, so that a VM can start from it instead of
+   registering the standard library and running a prelude again. Cells
+   refer to each other by index and builtins are stored as indices in
+   stdlib_builtins: an image does not depend on where things are loaded,
+   but only on the build which wrote it. See image.c for the format. */
+
+/* Writes the definitions seen by f to path. Returns NULL on success,
+   otherwise a static error message. Fibers and channels cannot be
+   dumped. */
+const char *jk_image_dump(jk_fiber_t *f, const char *path);
+
+/* Creates a VM from the image at path, like jk_vm_new. Returns NULL and
+   sets *error to a static message on failure. */
+jk_vm_t *jk_image_load(const char *path, size_t heap_cells, size_t words,
+                       const char **error);
+
+#endif
@@ -1,13 +1,18 @@
 #include "jiko.h"
-#include "heap.h"
-#include "word_table.h"
+#include "vm.h"
 
 void jiko_init() {
-    word_table_init(1024);
-    heap_init(65536);
+    jk_vm_enter(jk_vm_new(1 << 24, 1024));
+}
+
+const char *jiko_init_image(const char *path) {
+    const char *error;
+    jk_vm_t *vm = jk_image_load(path, 1 << 24, 1024, &error);
+    if (vm)
+        jk_vm_enter(vm);
+    return error;
 }
 
 void jiko_cleanup() {
-    heap_free();
-    word_table_free();
-}
\ No newline at end of file
+    jk_vm_free(jk_vm);
+}
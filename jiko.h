@@ -1,7 +1,22 @@
+#include "bigint.h"
+#include "chan.h"
 #include "eval.h"
 #include "heap.h"
+#include "image.h"
 #include "parser.h"
+#include "print.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "str.h"
+#include "trace.h"
 #include "types.h"
+#include "vector.h"
+#include "vm.h"
 
+/* Creates a VM and makes it current on the calling thread */
 void jiko_init();
+/* Same, starting from an image (see image.h). Returns NULL on success,
+   otherwise an error message, and no VM is created. */
+const char *jiko_init_image(const char *path);
+/* Frees the current VM */
 void jiko_cleanup();
\ No newline at end of file
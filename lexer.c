@@ -1,208 +1,224 @@
 #include "lexer.h"
 #include "misc.h"
 #include <assert.h>
-#include <ctype.h> /* for isspace */
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-/* Token *********************************************************************/
-
-token_t *token_new(token_type type, const char *value, unsigned int line,
-                   unsigned int column) {
-    token_t *res = (token_t*)malloc(sizeof(token_t));
-    assert(res && "malloc failed");
-    res->type = type;
-    res->value = strdup(value);
-    res->line = line;
-    res->column = column;
-    return res;
-}
-
-token_t *token_clone(token_t* t) {
-    return token_new(
-            t->type, 
-            t->value,
-            t->line,
-            t->column);
-}
-
-void token_free(token_t *token) {
-    free((void *)token->value);
-    free(token);
-}
-
-/* TODO: remove when the parser is implemented ? */
-void token_print(token_t *token, void (*printer)(const char *)) {
-    char buf_int[32]; /* enough to hold 64bit integers */
-    printer("<");
-    sprintf(buf_int, "%d", token->line);
-    printer(buf_int);
-    printer(":");
-    sprintf(buf_int, "%d", token->column);
-    printer(buf_int);
-    printer(": \"");
-    printer(token->value);
-    printer("\" (");
-    sprintf(buf_int, "%d", token->type);
-    printer(buf_int);
-    printer(")>");
-}
-
-/*****************************************************************************/
-
 /* Lexer *********************************************************************/
 
-static void next_char(lexer_t *lex) {
-    if (lex->text[lex->pos] == '\n') {
-        lex->pos_line++;
-        lex->pos_column = 1;
-    } else {
-        lex->pos_column++;
-    }
-    lex->pos++;
-}
+/* Character classes. The text is NUL terminated, and NUL belongs to the
+   classes that end a scan, so the loops need no bounds check. */
+#define CC_SPACE 1   /* same characters as isspace in the C locale */
+#define CC_DIGIT 2
+#define CC_WORD_END 4   /* space, '[', ']', '"' or NUL */
+#define CC_STRING_END 8 /* '"', '\\' or NUL */
+
+static const unsigned char char_class[256] = {
+    [0] = CC_WORD_END | CC_STRING_END,
+    [' '] = CC_SPACE | CC_WORD_END,
+    ['\t'] = CC_SPACE | CC_WORD_END,
+    ['\n'] = CC_SPACE | CC_WORD_END,
+    ['\v'] = CC_SPACE | CC_WORD_END,
+    ['\f'] = CC_SPACE | CC_WORD_END,
+    ['\r'] = CC_SPACE | CC_WORD_END,
+    ['['] = CC_WORD_END,
+    [']'] = CC_WORD_END,
+    ['"'] = CC_WORD_END | CC_STRING_END,
+    ['\\'] = CC_STRING_END,
+    ['0'] = CC_DIGIT, ['1'] = CC_DIGIT, ['2'] = CC_DIGIT, ['3'] = CC_DIGIT,
+    ['4'] = CC_DIGIT, ['5'] = CC_DIGIT, ['6'] = CC_DIGIT, ['7'] = CC_DIGIT,
+    ['8'] = CC_DIGIT, ['9'] = CC_DIGIT,
+};
+
+#define CLASS(c) (char_class[(unsigned char)(c)])
 
-static void update_start(lexer_t *lex) {
-    lex->start_line = lex->pos_line;
-    lex->start_column = lex->pos_column;
-    lex->start = lex->pos;
-}
-
-static void skip_space(lexer_t *lex) {
-    while (lex->pos < lex->text_len && isspace(lex->text[lex->pos]))
-        next_char(lex);
-    update_start(lex);
-}
-
-/* Duplicates text */
 lexer_t *lexer_new() {
     lexer_t *res = (lexer_t *)malloc(sizeof(lexer_t));
     assert(res && "lexer_new: malloc failed");
     res->text = NULL;
-    res->text_len = 0;
-    res->start_line = res->start_column = 1;
-    res->pos_line = res->pos_column = 1;
-    res->start = res->pos = 0;
+    res->text_len = res->capacity = 0;
+    res->pos = 0;
+    res->line = res->column = 1;
     return res;
 }
 
 void lexer_free(lexer_t *lex) {
-    free((void *)lex->text);
+    if (lex->capacity)
+        free((void *)lex->text);
     free(lex);
 }
 
-void lexer_set_text(lexer_t *lex, const char *text) {
-    if(lex->text != NULL)
-        free((void*)lex->text);
-    lex->text = strdup(text);
-    lex->text_len = strlen(lex->text);
-    lex->start_column = 1;
-    lex->pos_column = 1;
-    lex->start = lex->pos = 0;
+/* Moves the position of the first character past text[0..len) */
+static void advance_position(lexer_t *lex, size_t len) {
+    const char *nl, *last = NULL, *end = lex->text + len;
+    for (nl = lex->text; (nl = memchr(nl, '\n', end - nl)) != NULL; last = ++nl)
+        lex->line++;
+    if (last)
+        lex->column = (unsigned int)(end - last) + 1;
+    else
+        lex->column += (unsigned int)len;
 }
 
-void lexer_add(lexer_t *lex, const char *text) {
-    lex->text = (char*)realloc((char*)lex->text, lex->text_len + strlen(text) + 1);
-    assert(lex->text);
-    strcat((char*)lex->text, text);
-    lex->text_len = strlen(lex->text);
+/* Starts a new text, after the previous one */
+static void reset_text(lexer_t *lex) {
+    if (lex->text != NULL) {
+        advance_position(lex, lex->text_len);
+        lex->column = 1;
+    }
+    if (lex->capacity == 0)
+        lex->text = NULL;
+    lex->text_len = 0;
+    lex->pos = 0;
 }
 
-static token_t *lexer_open_bracket(lexer_t *lex) {
-    token_t *res =
-        token_new(TOK_OPEN_BRACKET, "[", lex->start_line, lex->start_column);
-    next_char(lex);
-    update_start(lex);
-    return res;
+void lexer_set_text(lexer_t *lex, const char *text) {
+    reset_text(lex);
+    lexer_add(lex, text, strlen(text));
+}
+
+void lexer_set_view(lexer_t *lex, const char *text, size_t len) {
+    assert(text[len] == 0);
+    reset_text(lex);
+    if (lex->capacity)
+        free((void *)lex->text);
+    lex->text = text;
+    lex->text_len = len;
+    lex->capacity = 0;
+}
+
+void lexer_add(lexer_t *lex, const char *text, size_t len) {
+    if (lex->text_len + len + 1 > lex->capacity) {
+        size_t capacity = lex->capacity ? lex->capacity : 256;
+        char *buffer = lex->capacity ? (char *)lex->text : NULL;
+        while (capacity < lex->text_len + len + 1)
+            capacity *= 2;
+        buffer = (char *)realloc(buffer, capacity);
+        if (!buffer)
+            jiko_panic("lexer_add: realloc failed");
+        /* a view is copied before it is extended */
+        if (!lex->capacity && lex->text_len)
+            memcpy(buffer, lex->text, lex->text_len);
+        lex->text = buffer;
+        lex->capacity = capacity;
+    }
+    memcpy((char *)lex->text + lex->text_len, text, len);
+    lex->text_len += len;
+    ((char *)lex->text)[lex->text_len] = 0;
+}
+
+void lexer_discard(lexer_t *lex, size_t offset) {
+    assert(offset <= lex->pos && lex->pos <= lex->text_len);
+    if (offset == 0)
+        return;
+    advance_position(lex, offset);
+    if (lex->capacity)
+        memmove((char *)lex->text, lex->text + offset,
+                lex->text_len - offset + 1);
+    else
+        lex->text += offset;
+    lex->text_len -= offset;
+    lex->pos -= offset;
+}
+
+void lexer_locate(lexer_t *lex, size_t offset, unsigned int *line,
+                  unsigned int *column) {
+    const char *nl = lex->text, *last = NULL;
+    unsigned int n = 0;
+    assert(offset <= lex->text_len);
+    while ((nl = memchr(nl, '\n', lex->text + offset - nl)) != NULL) {
+        n++;
+        last = ++nl;
+    }
+    *line = lex->line + n;
+    if (last)
+        *column = (unsigned int)(lex->text + offset - last) + 1;
+    else
+        *column = lex->column + (unsigned int)offset;
 }
 
-static token_t *lexer_close_bracket(lexer_t *lex) {
-    token_t *res =
-        token_new(TOK_CLOSE_BRACKET, "]", lex->start_line, lex->start_column);
-    next_char(lex);
-    update_start(lex);
+static token_t make_token(token_type type, size_t start, size_t end) {
+    token_t res;
+    res.type = type;
+    res.offset = start;
+    res.length = end - start;
+    res.error = NULL;
     return res;
 }
 
-static token_t *lexer_integer(lexer_t *lex) {
-    while (lex->pos < lex->text_len && isdigit(lex->text[lex->pos]))
-        next_char(lex);
-    char *strval = strndup(&lex->text[lex->start], lex->pos - lex->start);
-    token_t *res =
-        token_new(TOK_INTEGER, strval, lex->start_line, lex->start_column);
-    update_start(lex);
-    free(strval);
+static token_t make_error(size_t start, size_t end, const char *msg) {
+    token_t res = make_token(TOK_ERROR, start, end);
+    res.error = msg;
     return res;
 }
 
-static token_t *lexer_string(lexer_t *lex) {
-    next_char(lex); /* we match the '"' */
+static token_t lexer_string(lexer_t *lex, size_t start) {
+    const char *s = lex->text;
+    size_t pos = start + 1; /* we match the '"' */
     while (1) {
-        if (lex->pos >= lex->text_len)
-            return token_new(TOK_ERROR, "Unexpected end of line in string literal",
-                             lex->start_line, lex->start_column);
-        if (lex->text[lex->pos] == '"')
+        while (!(CLASS(s[pos]) & CC_STRING_END))
+            pos++;
+        if (s[pos] == '"')
             break;
-        if (lex->text[lex->pos] == '\\') {
-            next_char(lex);
-            if (lex->pos >= lex->text_len)
-                return token_new(TOK_ERROR, "Unexpected end of line in string literal",
-                                 lex->start_line, lex->start_column);
-            switch (lex->text[lex->pos]) {
+        if (s[pos] == '\\') {
+            pos++;
+            switch (s[pos]) {
             case 'n':
             case 'r':
             case 't':
             case '"':
             case '\\':
+                pos++;
+                continue;
+            case 0:
                 break;
             default:
-                return token_new(TOK_ERROR, "Invalid escaped character",
-                                 lex->start_line, lex->start_column);
+                lex->pos = pos;
+                return make_error(start, pos, "Invalid escaped character");
             }
         }
-        next_char(lex);
+        lex->pos = pos;
+        return make_error(start, pos, "Unexpected end of line in string literal");
     }
-    assert(lex->text[lex->pos] == '"'); /* should always be the case */
-    next_char(lex);
-    char *strval = strndup(&lex->text[lex->start], lex->pos - lex->start);
-    token_t *res =
-        token_new(TOK_STRING, strval, lex->start_line, lex->start_column);
-    update_start(lex);
-    free(strval);
-    return res;
-}
-
-static token_t *lexer_word(lexer_t *lex) {
-    while (1) {
-        if (lex->pos >= lex->text_len)
-            break;
-        char c = lex->text[lex->pos];
-        if (isspace(c) || c == '[' || c == ']' || c == '"')
-            break;
-        next_char(lex);
+    lex->pos = pos + 1;
+    return make_token(TOK_STRING, start, lex->pos);
+}
+
+token_t lexer_next(lexer_t *lex) {
+    const char *s = lex->text;
+    size_t pos = lex->pos, start;
+    if (!s)
+        return make_token(TOK_EOF, 0, 0);
+    while (CLASS(s[pos]) & CC_SPACE)
+        pos++;
+    start = pos;
+    switch (s[pos]) {
+    case 0:
+        assert(pos == lex->text_len);
+        lex->pos = pos;
+        return make_token(TOK_EOF, pos, pos);
+    case '[':
+        lex->pos = pos + 1;
+        return make_token(TOK_OPEN_BRACKET, start, pos + 1);
+    case ']':
+        lex->pos = pos + 1;
+        return make_token(TOK_CLOSE_BRACKET, start, pos + 1);
+    case '"':
+        return lexer_string(lex, start);
     }
-    char *strval = strndup(&lex->text[lex->start], lex->pos - lex->start);
-    token_t *res =
-        token_new(TOK_WORD, strval, lex->start_line, lex->start_column);
-    lex->start = lex->pos;
-    free(strval);
-    return res;
+    if (CLASS(s[pos]) & CC_DIGIT) {
+        while (CLASS(s[++pos]) & CC_DIGIT)
+            ;
+        lex->pos = pos;
+        return make_token(TOK_INTEGER, start, pos);
+    }
+    while (!(CLASS(s[++pos]) & CC_WORD_END))
+        ;
+    lex->pos = pos;
+    return make_token(TOK_WORD, start, pos);
 }
 
-token_t *lexer_next(lexer_t *lex) {
-    skip_space(lex);
-    if (lex->pos >= lex->text_len)
-        return token_new(TOK_EOF, "", lex->start_line, lex->start_column);
-    char c = lex->text[lex->pos];
-    if (c == '[')
-        return lexer_open_bracket(lex);
-    else if (c == ']')
-        return lexer_close_bracket(lex);
-    else if (isdigit(c))
-        return lexer_integer(lex);
-    else if (c == '"')
-        return lexer_string(lex);
-    else
-        return lexer_word(lex);
-}
\ No newline at end of file
+#undef CC_SPACE
+#undef CC_DIGIT
+#undef CC_WORD_END
+#undef CC_STRING_END
+#undef CLASS
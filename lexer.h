@@ -15,31 +15,41 @@ typedef enum token_type {
     TOK_EOF,
 } token_type;
 
+/* Tokens are views into the text of the lexer: they do not own any memory
+   and stay valid until the text is replaced. The position of a token is
+   only computed when needed, see lexer_locate. */
 typedef struct token {
     enum token_type type;
-    const char *value;
-    unsigned int line, column;
+    size_t offset, length; /* characters of the token in the text */
+    const char *error;     /* static message of a TOK_ERROR */
 } token_t;
 
-token_t *token_new(token_type type, const char *value, unsigned int line,
-                   unsigned int column);
-token_t *token_clone(token_t*);
-void token_free(token_t *token);
-void token_print(token_t *token, void (*printer)(const char *));
-
 /* Lexer ******************************************************************* */
 
 typedef struct lexer {
-    const char *text;
-    size_t text_len;
-    unsigned int start, pos;
-    unsigned int start_line, start_column, pos_line, pos_column;
+    const char *text; /* NUL terminated */
+    size_t text_len, capacity; /* capacity is 0 when text is not owned */
+    size_t pos;
+    unsigned int line, column; /* position of the first character of text */
 } lexer_t;
 
 lexer_t *lexer_new();
 void lexer_free(lexer_t *lex);
+/* Duplicates text */
 void lexer_set_text(lexer_t *lex, const char *text) ;
-void lexer_add(lexer_t *lex, const char *text);
-token_t *lexer_next(lexer_t *lexer);
-
-#endif
\ No newline at end of file
+/* Lexes text in place: it must stay valid until the lexer gets another
+   text or is freed, and text[len] must be NUL */
+void lexer_set_view(lexer_t *lex, const char *text, size_t len);
+/* Appends len characters, growing the text geometrically */
+void lexer_add(lexer_t *lex, const char *text, size_t len);
+/* Drops the characters before offset, which no token may refer to anymore.
+   Positions are still reported from the start of the input. */
+void lexer_discard(lexer_t *lex, size_t offset);
+token_t lexer_next(lexer_t *lexer);
+/* First character of t */
+#define lexer_token_text(lex, t) (&(lex)->text[(t).offset])
+/* Line and column (1-based) of the character at offset */
+void lexer_locate(lexer_t *lex, size_t offset, unsigned int *line,
+                  unsigned int *column);
+
+#endif
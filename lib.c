@@ -1,114 +1,153 @@
 #include "lib.h"
+#include "bigint.h"
+#include "chan.h"
 #include "env.h"
 #include "eval.h"
 #include "heap.h"
+#include "print.h"
+#include "scheduler.h"
+#include "str.h"
+#include "vector.h"
+#include "vm.h"
+#include "word_table.h"
 #include <assert.h>
+#include <sched.h>
+#include <stdlib.h>
+
+/* Arithmetic stays on JK_INT_CTYPE as long as the result fits. Otherwise,
+   or when an operand is a bignum already, both operands go through
+   jk_bigint_t. */
+
+static jk_bigint_t *to_bigint(jk_object_t j) {
+    return jk_get_type(j) == JK_BIGINT ? AS_BIGINT(j)
+                                       : jk_bigint_from_int(AS_INT(j));
+}
+
+static void release_bigint(jk_object_t j, jk_bigint_t *b) {
+    if (jk_get_type(j) != JK_BIGINT)
+        free(b);
+}
+
+static void bigint_op(jk_fiber_t *f, jk_object_t a, jk_object_t b,
+                      jk_bigint_t *(*op)(const jk_bigint_t *,
+                                         const jk_bigint_t *)) {
+    jk_bigint_t *x = to_bigint(a), *y = to_bigint(b);
+    jk_push(f, jk_make_bigint(op(x, y)));
+    release_bigint(a, x);
+    release_bigint(b, y);
+}
+
+/* Pops the two operands of an arithmetic builtin, returns 1 when they are
+   both JK_INT */
+static int pop_operands(jk_fiber_t *f, jk_object_t *a, jk_object_t *b) {
+    if (!jk_pop_integer(f, b) || !jk_pop_integer(f, a))
+        return -1;
+    return jk_get_type(*a) == JK_INT && jk_get_type(*b) == JK_INT;
+}
 
 void add(jk_fiber_t *f) {
     jk_object_t a, b;
-    if (!jk_pop_int(f, &b))
-        return;
-    if (!jk_pop_int(f, &a)) {
-        jk_object_free(b);
+    JK_INT_CTYPE c;
+    int small = pop_operands(f, &a, &b);
+    if (small < 0)
         return;
-    }
-    JK_INT_CTYPE c = AS_INT(a) + AS_INT(b);
-    jk_object_free(a);
-    jk_object_free(b);
-    jk_push(f, jk_make_int(c));
+    if (small && !JK_ADD_OVERFLOW(AS_INT(a), AS_INT(b), &c))
+        jk_push(f, jk_make_int(c));
+    else
+        bigint_op(f, a, b, jk_bigint_add);
 }
 
 void sub(jk_fiber_t *f) {
     jk_object_t a, b;
-    if (!jk_pop_int(f, &b))
-        return;
-    if (!jk_pop_int(f, &a)) {
-        jk_object_free(b);
+    JK_INT_CTYPE c;
+    int small = pop_operands(f, &a, &b);
+    if (small < 0)
         return;
-    }
-    JK_INT_CTYPE c = AS_INT(a) - AS_INT(b);
-    jk_object_free(a);
-    jk_object_free(b);
-    jk_push(f, jk_make_int(c));
+    if (small && !JK_SUB_OVERFLOW(AS_INT(a), AS_INT(b), &c))
+        jk_push(f, jk_make_int(c));
+    else
+        bigint_op(f, a, b, jk_bigint_sub);
 }
 
 void mul(jk_fiber_t *f) {
     jk_object_t a, b;
-    if (!jk_pop_int(f, &b))
+    JK_INT_CTYPE c;
+    int small = pop_operands(f, &a, &b);
+    if (small < 0)
         return;
-    if (!jk_pop_int(f, &a)) {
-        jk_object_free(b);
-        return;
-    }
-    JK_INT_CTYPE c = AS_INT(a) * AS_INT(b);
-    jk_object_free(a);
-    jk_object_free(b);
-    jk_push(f, jk_make_int(c));
+    if (small && !JK_MUL_OVERFLOW(AS_INT(a), AS_INT(b), &c))
+        jk_push(f, jk_make_int(c));
+    else
+        bigint_op(f, a, b, jk_bigint_mul);
+}
+
+static jk_bigint_t *bigint_div(const jk_bigint_t *a, const jk_bigint_t *b) {
+    jk_bigint_t *q;
+    jk_bigint_divmod(a, b, &q, NULL);
+    return q;
+}
+
+static jk_bigint_t *bigint_mod(const jk_bigint_t *a, const jk_bigint_t *b) {
+    jk_bigint_t *r;
+    jk_bigint_divmod(a, b, NULL, &r);
+    return r;
 }
 
+/* A bignum is never 0, and the only quotient of JK_INT that overflows is
+   JK_INT_CTYPE_MIN / -1 */
+#define DIVISION_FITS(a, b)                                                    \
+    (AS_INT(a) != JK_INT_CTYPE_MIN || AS_INT(b) != -1)
+
 void _div(jk_fiber_t *f) {
     jk_object_t a, b;
-    if (!jk_pop_int(f, &b))
-        return;
-    if (!jk_pop_int(f, &a)) {
-        jk_object_free(b);
+    int small = pop_operands(f, &a, &b);
+    if (small < 0)
         return;
-    }
-    if (AS_INT(b) == 0) {
-        jk_object_free(b);
-        jk_object_free(a);
+    if (jk_get_type(b) == JK_INT && AS_INT(b) == 0) {
         jk_raise_error(f, "division by zero");
         return;
     }
-    JK_INT_CTYPE c = AS_INT(a) / AS_INT(b);
-    jk_object_free(a);
-    jk_object_free(b);
-    jk_push(f, jk_make_int(c));
+    if (small && DIVISION_FITS(a, b))
+        jk_push(f, jk_make_int(AS_INT(a) / AS_INT(b)));
+    else
+        bigint_op(f, a, b, bigint_div);
 }
 
 void mod(jk_fiber_t *f) {
     jk_object_t a, b;
-    if (!jk_pop_int(f, &b))
+    int small = pop_operands(f, &a, &b);
+    if (small < 0)
         return;
-    if (!jk_pop_int(f, &a)) {
-        jk_object_free(b);
-        return;
-    }
-    if (AS_INT(b) == 0) {
-        jk_object_free(b);
-        jk_object_free(a);
+    if (jk_get_type(b) == JK_INT && AS_INT(b) == 0) {
         jk_raise_error(f, "division by zero");
         return;
     }
-    JK_INT_CTYPE c = AS_INT(a) % AS_INT(b);
-    jk_object_free(a);
-    jk_object_free(b);
-    jk_push(f, jk_make_int(c));
+    if (small && DIVISION_FITS(a, b))
+        jk_push(f, jk_make_int(AS_INT(a) % AS_INT(b)));
+    else
+        bigint_op(f, a, b, bigint_mod);
 }
 
+#undef DIVISION_FITS
+
 void _dup(jk_fiber_t *f) {
     jk_object_t j;
-    if (!jk_pop(f, &j))
+    if (!jk_peek(f, 0, &j))
         return;
-    jk_object_t jc = jk_object_clone(j);
     jk_push(f, j);
-    jk_push(f, jc);
 }
 
 void drop(jk_fiber_t *f) {
     jk_object_t j;
-    if (jk_pop(f, &j))
-        jk_object_free(j);
+    jk_pop(f, &j);
 }
 
 void swap(jk_fiber_t *f) {
     jk_object_t a, b;
     if (!jk_pop(f, &b))
         return;
-    if (!jk_pop(f, &a)) {
-        jk_object_free(b);
+    if (!jk_pop(f, &a))
         return;
-    }
     jk_push(f, b);
     jk_push(f, a);
 }
@@ -121,48 +160,47 @@ void _false(jk_fiber_t *f) {
     jk_push(f, jk_make_bool(0));
 }
 
+/* Integers have a single representation: a JK_INT never equals a bignum.
+   Strings are equal when their characters are. */
 void equal(jk_fiber_t *f) {
     jk_object_t a, b;
-    if(!jk_pop_int(f, &b))
+    if(!jk_peek(f, 0, &b))
         return;
-    if(!jk_pop_int(f, &a)) {
-        jk_object_free(b);
+    if(jk_get_type(b) == JK_STRING) {
+        jk_pop(f, &b);
+        if(!jk_pop_string(f, &a))
+            return;
+        jk_push(f, jk_make_bool(jk_string_equal(a, b)));
         return;
     }
-    jk_object_t j = jk_make_bool(AS_INT(a)==AS_INT(b));
-    jk_push(f, j);
-    jk_object_free(a);
-    jk_object_free(b);
+    int small = pop_operands(f, &a, &b);
+    if (small < 0)
+        return;
+    if (small)
+        jk_push(f, jk_make_bool(AS_INT(a) == AS_INT(b)));
+    else if (jk_get_type(a) == JK_BIGINT && jk_get_type(b) == JK_BIGINT)
+        jk_push(f, jk_make_bool(
+                       jk_bigint_compare(AS_BIGINT(a), AS_BIGINT(b)) == 0));
+    else
+        jk_push(f, jk_make_bool(0));
 }
 
 void ifte(jk_fiber_t *f) {
     jk_object_t cond, th, el;
     if(!jk_pop_quotation(f, &el))
         return;
-    if(!jk_pop_quotation(f, &th)) {
-        jk_object_free(el);
+    if(!jk_pop_quotation(f, &th))
         return;
-    }
-    if(!jk_pop_bool(f, &cond)) {
-        jk_object_free(th);
-        jk_object_free(el);
+    if(!jk_pop_bool(f, &cond))
         return;
-    }
-    if(AS_BOOL(cond)) {
-        f->queue = jk_concat(th, f->queue);
-        jk_object_free(el);
-    } else {
-        f->queue = jk_concat(el, f->queue);
-        jk_object_free(th);
-    }
-    jk_object_free(cond);
+    jk_fiber_call(f, AS_BOOL(cond) ? th : el);
 }
 
 void call(jk_fiber_t *f) {
     jk_object_t q;
     if(!jk_pop_quotation(f, &q))
         return;
-    f->queue = jk_concat(q, f->queue);
+    jk_fiber_call(f, q);
 }
 
 void single_quote(jk_fiber_t *f) {
@@ -178,10 +216,8 @@ void def(jk_fiber_t *f) {
     jk_object_t name, body;
     if(!jk_pop_word(f, &name))
         return;
-    if(!jk_pop(f, &body)) {
-        jk_object_free(name);
+    if(!jk_pop(f, &body))
         return;
-    }
     jk_define(f, name, jk_make_pair(body, JK_NIL));
 }
 
@@ -189,13 +225,349 @@ void defn(jk_fiber_t *f) {
     jk_object_t name, body;
     if(!jk_pop_word(f, &name))
         return;
-    if(!jk_pop_quotation(f, &body)) {
-        jk_object_free(name);
+    if(!jk_pop_quotation(f, &body))
         return;
-    }
     jk_define(f, name, jk_make_pair(body, jk_make_pair(jk_make_word_from_string("call"), JK_NIL)));
 }
 
+/* ( x -- ) */
+void print(jk_fiber_t *f) {
+    jk_object_t j;
+    jk_buf_t b;
+    if(!jk_pop(f, &j))
+        return;
+    jk_buf_init(&b);
+    jk_buf_object(&b, j, 0);
+    jk_buf_put(&b, "\n", 1);
+    jk_buf_flush(&b);
+    jk_buf_free(&b);
+}
+
+/* ( -- q ) pushes the counters of jk_heap_stats, each a number:
+   [in-use peak capacity allocated freed string-bytes vector-bytes int bool
+    string word quotation builtin fiber error channel bigint vector]
+   where the last eleven are the cells in use by type. The quotation
+   itself is not counted. */
+void heap_stats(jk_fiber_t *f) {
+    jk_heap_stats_t s;
+    size_t values[7 + JK_HEAP_TYPES];
+    jk_object_t res = JK_NIL;
+    jk_heap_stats(&s);
+    values[0] = s.in_use;
+    values[1] = s.peak;
+    values[2] = s.capacity;
+    values[3] = s.allocated;
+    values[4] = s.freed;
+    values[5] = s.string_bytes;
+    values[6] = s.vector_bytes;
+    for (size_t i = 0; i < JK_HEAP_TYPES; i++)
+        values[7 + i] = s.types[i];
+    for (size_t i = sizeof(values) / sizeof(*values); i-- > 0;)
+        res = jk_make_pair(jk_make_int((JK_INT_CTYPE)values[i]), res);
+    jk_push(f, res);
+}
+
+/* Fibers ********************************************************************/
+
+/* ( q -- fiber ) runs q in a new fiber, whose scope inherits the current
+   one */
+void spawn(jk_fiber_t *f) {
+    jk_object_t q;
+    if(!jk_pop_quotation(f, &q))
+        return;
+    jk_fiber_t *child = jk_fiber_spawn(f);
+    jk_fiber_call(child, q);
+    jk_sched_add(child);
+    jk_push(f, child->self);
+}
+
+void yield(jk_fiber_t *f) {
+    f->suspend = 1;
+}
+
+/* ( fiber -- x ) waits for the fiber to be done and pushes its top */
+void join(jk_fiber_t *f) {
+    jk_object_t j;
+    if(!jk_pop(f, &j))
+        return;
+    if(jk_get_type(j) != JK_FIBER) {
+        jk_raise_error(f, "expected fiber");
+        return;
+    }
+    jk_fiber_t *t = AS_FIBER(j);
+    if(!t) {
+        jk_raise_error(f, "dead fiber");
+        return;
+    }
+    if(t->state != JK_FIBER_IDLE) {
+        if(!jk_sched_block(f, t)) {
+            jk_raise_error(f, "deadlock");
+            return;
+        }
+        /* join again when woken up */
+        jk_push(f, j);
+        jk_fiber_call(f, jk_make_pair(jk_make_builtin(join), JK_NIL));
+        return;
+    }
+    if(t->stack.size == 0) {
+        jk_raise_error(f, "joined fiber has an empty stack");
+        return;
+    }
+    jk_push(f, t->stack.items[t->stack.size - 1]);
+}
+
+void self(jk_fiber_t *f) {
+    jk_push(f, jk_make_fiber(f));
+}
+
+/* Channels ******************************************************************/
+
+/* ( n -- chan ) new local channel holding up to n values */
+void chan(jk_fiber_t *f) {
+    jk_object_t n;
+    if(!jk_pop_int(f, &n))
+        return;
+    if(AS_INT(n) <= 0 || (size_t)AS_INT(n) > JK_CHAN_MAX_CAPACITY) {
+        jk_raise_error(f, "channel capacity out of range");
+        return;
+    }
+    jk_chan_t *c = jk_chan_new((size_t)AS_INT(n), JK_CHAN_LOCAL);
+    jk_push(f, jk_make_chan(c));
+    jk_chan_release(c);
+}
+
+static int pop_chan(jk_fiber_t *f, jk_object_t *res) {
+    if(!jk_pop(f, res))
+        return 0;
+    if(jk_get_type(*res) != JK_CHANNEL)
+        return jk_raise_error(f, "expected channel");
+    return 1;
+}
+
+/* Suspends f until the builtin can run again with its arguments, pushed
+   back on the stack. Fibers wait in q on a local channel and retry at
+   their next slice on a shared one. */
+static void chan_wait(jk_fiber_t *f, jk_object_t ch, jk_fiber_queue_t *q,
+                      void (*builtin)(jk_fiber_t *)) {
+    jk_push(f, ch);
+    jk_fiber_call(f, jk_make_pair(jk_make_builtin(builtin), JK_NIL));
+    if(jk_chan_is_shared(AS_CHAN(ch))) {
+        f->suspend = 1;
+        /* the other end is on another thread, let it run */
+        if(!jk_vm->sched.run.head)
+            sched_yield();
+    } else {
+        jk_sched_wait(f, q);
+    }
+}
+
+/* ( x chan -- ) values sent on a shared channel must not hold fibers or
+   local channels, which cannot leave their VM */
+void _send(jk_fiber_t *f) {
+    jk_object_t ch, x;
+    if(!pop_chan(f, &ch))
+        return;
+    if(!jk_pop(f, &x))
+        return;
+    jk_chan_t *c = AS_CHAN(ch);
+    switch(jk_chan_try_send(c, x)) {
+    case 1:
+        jk_sched_wake(jk_chan_receivers(c));
+        break;
+    case 0:
+        jk_push(f, x);
+        chan_wait(f, ch, jk_chan_senders(c), _send);
+        break;
+    default:
+        jk_raise_error(f, "fibers and local channels cannot be sent to "
+                          "another VM");
+        break;
+    }
+}
+
+/* ( chan -- x ) */
+void _recv(jk_fiber_t *f) {
+    jk_object_t ch, x;
+    if(!pop_chan(f, &ch))
+        return;
+    jk_chan_t *c = AS_CHAN(ch);
+    if(!jk_chan_try_recv(c, &x)) {
+        chan_wait(f, ch, jk_chan_receivers(c), _recv);
+        return;
+    }
+    jk_sched_wake(jk_chan_senders(c));
+    jk_push(f, x);
+}
+
+/* Strings *******************************************************************/
+
+/* ( s1 s2 -- s ) */
+void concat(jk_fiber_t *f) {
+    jk_object_t a, b;
+    if(!jk_pop_string(f, &b))
+        return;
+    if(!jk_pop_string(f, &a))
+        return;
+    jk_push(f, jk_string_concat(a, b));
+}
+
+/* ( s -- n ) length in bytes */
+void length(jk_fiber_t *f) {
+    jk_object_t s;
+    if(!jk_pop_string(f, &s))
+        return;
+    jk_push(f, jk_make_int((JK_INT_CTYPE)jk_string_length(s)));
+}
+
+/* ( s start end -- s ) bytes from start to end excluded */
+void slice(jk_fiber_t *f) {
+    jk_object_t s, start, end;
+    if(!jk_pop_int(f, &end))
+        return;
+    if(!jk_pop_int(f, &start))
+        return;
+    if(!jk_pop_string(f, &s))
+        return;
+    if(AS_INT(start) < 0 || AS_INT(start) > AS_INT(end) ||
+       (size_t)AS_INT(end) > jk_string_length(s)) {
+        jk_raise_error(f, "slice out of range");
+        return;
+    }
+    jk_push(f, jk_string_slice(s, (size_t)AS_INT(start),
+                               (size_t)AS_INT(end)));
+}
+
+/* Vectors *******************************************************************/
+
+static int pop_vector(jk_fiber_t *f, jk_object_t *res) {
+    if(!jk_pop(f, res))
+        return 0;
+    if(jk_get_type(*res) != JK_VECTOR)
+        return jk_raise_error(f, "expected vector");
+    return 1;
+}
+
+/* Pops two vectors of the same length, b on top of a */
+static int pop_vectors(jk_fiber_t *f, jk_object_t *a, jk_object_t *b) {
+    if(!pop_vector(f, b))
+        return 0;
+    if(!pop_vector(f, a))
+        return 0;
+    if(AS_VECTOR(*a)->len != AS_VECTOR(*b)->len)
+        return jk_raise_error(f, "vectors of different lengths");
+    return 1;
+}
+
+/* ( q -- v ) vector of the integers in q */
+void to_vector(jk_fiber_t *f) {
+    jk_object_t q, ji;
+    size_t len = 0;
+    if(!jk_pop_quotation(f, &q))
+        return;
+    for(ji = q; ji != JK_NIL; ji = CDR(ji), len++)
+        if(jk_get_type(CAR(ji)) != JK_INT) {
+            jk_raise_error(f, "expected a quotation of integers");
+            return;
+        }
+    jk_vector_t *v = jk_vector_new(len);
+    len = 0;
+    for(ji = q; ji != JK_NIL; ji = CDR(ji))
+        v->items[len++] = (int64_t)AS_INT(CAR(ji));
+    jk_push(f, jk_make_vector(v));
+}
+
+/* ( v -- q ) quotation of the items of v */
+void from_vector(jk_fiber_t *f) {
+    jk_object_t v, res = JK_NIL;
+    if(!pop_vector(f, &v))
+        return;
+    for(size_t i = AS_VECTOR(v)->len; i-- > 0;)
+        res = jk_make_pair(jk_make_int64(AS_VECTOR(v)->items[i]), res);
+    jk_push(f, res);
+}
+
+/* ( v -- n ) */
+void vlength(jk_fiber_t *f) {
+    jk_object_t v;
+    if(!pop_vector(f, &v))
+        return;
+    jk_push(f, jk_make_int((JK_INT_CTYPE)AS_VECTOR(v)->len));
+}
+
+static void elementwise(jk_fiber_t *f,
+                        void (*op)(int64_t *, const int64_t *,
+                                   const int64_t *, size_t)) {
+    jk_object_t a, b;
+    if(!pop_vectors(f, &a, &b))
+        return;
+    jk_vector_t *r = jk_vector_new(AS_VECTOR(a)->len);
+    op(r->items, AS_VECTOR(a)->items, AS_VECTOR(b)->items, r->len);
+    jk_push(f, jk_make_vector(r));
+}
+
+/* ( v1 v2 -- v ) item by item, v1 and v2 having the same length */
+void vadd(jk_fiber_t *f) {
+    elementwise(f, jk_vector_add);
+}
+
+void vsub(jk_fiber_t *f) {
+    elementwise(f, jk_vector_sub);
+}
+
+void vmul(jk_fiber_t *f) {
+    elementwise(f, jk_vector_mul);
+}
+
+/* ( v n -- v ) every item times n */
+void vscale(jk_fiber_t *f) {
+    jk_object_t v, n;
+    if(!jk_pop_int(f, &n))
+        return;
+    if(!pop_vector(f, &v))
+        return;
+    jk_vector_t *r = jk_vector_new(AS_VECTOR(v)->len);
+    jk_vector_scale(r->items, AS_VECTOR(v)->items, (int64_t)AS_INT(n), r->len);
+    jk_push(f, jk_make_vector(r));
+}
+
+/* ( v -- n ) */
+void vsum(jk_fiber_t *f) {
+    jk_object_t v;
+    if(!pop_vector(f, &v))
+        return;
+    jk_push(f, jk_vector_sum(AS_VECTOR(v)->items, AS_VECTOR(v)->len));
+}
+
+/* ( v1 v2 -- n ) sum of the products of the items */
+void vdot(jk_fiber_t *f) {
+    jk_object_t a, b;
+    if(!pop_vectors(f, &a, &b))
+        return;
+    jk_push(f, jk_vector_dot(AS_VECTOR(a)->items, AS_VECTOR(b)->items,
+                             AS_VECTOR(a)->len));
+}
+
+static void extremum(jk_fiber_t *f,
+                     int64_t (*op)(const int64_t *, size_t)) {
+    jk_object_t v;
+    if(!pop_vector(f, &v))
+        return;
+    if(AS_VECTOR(v)->len == 0) {
+        jk_raise_error(f, "empty vector");
+        return;
+    }
+    jk_push(f, jk_make_int64(op(AS_VECTOR(v)->items, AS_VECTOR(v)->len)));
+}
+
+/* ( v -- n ) v is not empty */
+void vmin(jk_fiber_t *f) {
+    extremum(f, jk_vector_min);
+}
+
+void vmax(jk_fiber_t *f) {
+    extremum(f, jk_vector_max);
+}
+
 builtins_table_entry_t stdlib_builtins[] = {
     {"+", add},
     {"-", sub},
@@ -213,15 +585,38 @@ builtins_table_entry_t stdlib_builtins[] = {
     {"'", single_quote},
     {"def", def},
     {"defn", defn},
+    {"print", print},
+    {"spawn", spawn},
+    {"yield", yield},
+    {"join", join},
+    {"self", self},
+    {"chan", chan},
+    {"send", _send},
+    {"recv", _recv},
+    {"heap-stats", heap_stats},
+    {"concat", concat},
+    {"length", length},
+    {"slice", slice},
+    {">vector", to_vector},
+    {"vector>", from_vector},
+    {"vlength", vlength},
+    {"v+", vadd},
+    {"v-", vsub},
+    {"v*", vmul},
+    {"vscale", vscale},
+    {"vsum", vsum},
+    {"vdot", vdot},
+    {"vmin", vmin},
+    {"vmax", vmax},
     {NULL, NULL}
 };
 
-void register_lib(jk_fiber_t *f, builtins_table_entry_t *tbl) {
+void register_lib(struct jk_env *env, builtins_table_entry_t *tbl) {
     int i = 0;
     while(tbl[i].name) {
         const char *name = tbl[i].name;
         void (*builtin)(jk_fiber_t*) = tbl[i].builtin;
-        jk_define(f, jk_make_word_from_string(name), jk_make_pair(jk_make_builtin(builtin), JK_NIL));    
+        jk_env_define(env, word_from_string(name), jk_make_pair(jk_make_builtin(builtin), JK_NIL));
         i++;
     }
 }
\ No newline at end of file
@@ -5,6 +5,16 @@ typedef struct {
     void (*builtin)(jk_fiber_t*);
 } builtins_table_entry_t;
 
-void register_lib(jk_fiber_t *f, builtins_table_entry_t *tbl);
+/* Defines the builtins of tbl in env. Libraries registered in
+   jk_vm->builtins are seen by every host fiber of the VM. */
+void register_lib(struct jk_env *env, builtins_table_entry_t *tbl);
 
-extern builtins_table_entry_t stdlib_builtins[];
\ No newline at end of file
+extern builtins_table_entry_t stdlib_builtins[];
+
+/* Builtins the compiler fuses into superinstructions */
+void add(jk_fiber_t *f);
+void sub(jk_fiber_t *f);
+void mul(jk_fiber_t *f);
+void _dup(jk_fiber_t *f);
+void equal(jk_fiber_t *f);
+void ifte(jk_fiber_t *f);
\ No newline at end of file
@@ -1,7 +1,20 @@
 #include "jiko.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+/* Input is read in chunks, which need not end on a line or a form */
+#define INPUT_CHUNK_SIZE (64 * 1024)
+/* Top-level forms of a script parsed before they are run */
+#define SCRIPT_BATCH_FORMS 1024
+
+/* Interactive: prompts, and prints the stack after each line. Otherwise
+   the input is streamed and the stack is printed at the end. */
 int repl = 1;
 
 int (*jk_printf)(const char *, ...) = printf;
@@ -12,84 +25,276 @@ void jiko_panic(const char *msg) {
     exit(1);
 }
 
-static int input(char *buffer, size_t size, int cont) {
-    *buffer = 0;
-    if(feof(stdin))
-        return 0;
+/* Returns the number of characters read, 0 at the end of the input */
+static size_t input(char *buffer, size_t size, int cont) {
+    ssize_t n;
     if(repl) {
         if(!cont)
             printf("> ");
         else
             printf("... ");
+        fflush(stdout);
+    }
+    do
+        n = read(STDIN_FILENO, buffer, size);
+    while (n < 0 && errno == EINTR);
+    return n > 0 ? (size_t)n : 0;
+}
+
+/* Runs the input of f, and the fibers it spawns. In the REPL, a line has a
+   budget of 1000 steps. */
+static void run(jk_fiber_t *f) {
+    jk_sched_add(f);
+    if (repl)
+        jk_sched_run(1000);
+    else
+        while (jk_sched_run((size_t)-1) == 0)
+            ;
+    /* f waits on a fiber or a local channel, and no fiber is left to wake
+       it up */
+    if (f->state == JK_FIBER_BLOCKED && !jk_vm->sched.run.head) {
+        jk_sched_remove(f);
+        jk_raise_error(f, "deadlock");
     }
-    fflush(stdout);
-    fgets(buffer, size, stdin);
-    return 1;
 }
 
-int main() {
-    jiko_init();
-    /* const char *input =
-        "1 2 3 + dup * swap [ a b [c d] def ] \"ab\\\"c\\\\\n\" dup [] [";
-    */
-    char input_buffer[1024];
+/* Maps the file read-only, followed by a NUL for the lexer: the file is
+   mapped over an anonymous region one byte longer, whose bytes past the
+   end of the file read as zeros. Returns NULL on failure. */
+static const char *map_file(const char *path, size_t *len) {
+    struct stat st;
+    char *res = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) == 0) {
+        *len = (size_t)st.st_size;
+        res = mmap(NULL, *len + 1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+        if (res == MAP_FAILED)
+            res = NULL;
+        else if (*len && mmap(res, *len, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+                              fd, 0) == MAP_FAILED) {
+            munmap(res, *len + 1);
+            res = NULL;
+        }
+    }
+    close(fd);
+    return res;
+}
+
+/* Defines args as the list of the arguments of the script */
+static void define_args(jk_fiber_t *f, int argc, char **argv) {
+    jk_object_t args = JK_NIL, tail = JK_NIL;
+    for (int i = 0; i < argc; i++) {
+        jk_object_t cell = jk_make_pair(jk_make_string(argv[i]), JK_NIL);
+        if (args == JK_NIL)
+            args = cell;
+        else
+            CDR(tail) = cell;
+        tail = cell;
+    }
+    jk_define(f, jk_make_word_from_string("args"), jk_make_pair(args, JK_NIL));
+}
+
+/* jiko file.jk [args]: runs the file to completion in f, without the REPL */
+static int run_script(jk_fiber_t *f, const char *path, int argc,
+                      char **argv) {
+    size_t len;
+    const char *text = map_file(path, &len);
+    if (!text) {
+        fprintf(stderr, "jiko: cannot read %s\n", path);
+        return 1;
+    }
     parser_t *parser = parser_new();
+    int status = 0;
+    jk_parse_result_t pr;
+    define_args(f, argc, argv);
+    parser_set_view(parser, text, len);
+    /* forms run in batches, so a large script does not sit in the heap */
+    for (size_t n = 1; (pr = parser_parse(parser)).type == JK_PARSE_OK; n++) {
+        jk_fiber_enqueue(f, pr.result.j);
+        if (n % SCRIPT_BATCH_FORMS == 0) {
+            run(f);
+            if (jk_error_raised(f))
+                break;
+        }
+    }
+    if (pr.type == JK_PARSE_EOF_OK) {
+        run(f);
+    } else if (pr.type != JK_PARSE_OK) { /* not stopped by an error */
+        fprintf(stderr, "%s:%s\n", path, pr.result.error_msg);
+        status = 1;
+    }
+    if (jk_error_raised(f)) {
+        jk_print_object(f->stack.items[f->stack.size - 1]);
+        jk_printf("\n");
+        status = 1;
+    }
+    jk_parse_result_free(pr);
+    parser_free(parser);
+    munmap((void *)text, len + 1);
+    return status;
+}
+
+/* JIKO_PROFILE=<file> samples every JIKO_PROFILE_PERIOD steps (1000 by
+   default), or microseconds when it ends with "us", and counts
+   instructions too if JIKO_PROFILE_PERF is set. At exit, the stacks go to
+   the file in folded form and the costs by word to stderr. */
+static const char *profile_path;
+
+static void start_profile() {
+    const char *period = getenv("JIKO_PROFILE_PERIOD");
+    unsigned long n = 1000;
+    int by_time = 0;
+    if (!(profile_path = getenv("JIKO_PROFILE")))
+        return;
+    if (period) {
+        char *end;
+        n = strtoul(period, &end, 10);
+        by_time = strcmp(end, "us") == 0;
+        if (by_time)
+            n *= 1000;
+    }
+    if (!jk_profile_enable(n, by_time, getenv("JIKO_PROFILE_PERF") != NULL))
+        fprintf(stderr, "jiko: perf_event_open failed, instructions are not "
+                        "counted\n");
+}
+
+static void finish_profile() {
+    FILE *out;
+    if (!profile_path)
+        return;
+    if (!(out = fopen(profile_path, "w"))) {
+        fprintf(stderr, "jiko: %s: %s\n", profile_path, strerror(errno));
+        return;
+    }
+    jk_profile_write_folded(out);
+    fclose(out);
+    jk_profile_write_words(stderr);
+}
+
+/* JIKO_PRINT_LIMIT=<bytes> cuts the stack the REPL prints after each
+   line, which may hold values of any size */
+static size_t print_limit;
+
+static void print_state(jk_fiber_t *f) {
+    jk_buf_t b;
+    jk_buf_init(&b);
+    jk_buf_fiber(&b, f, print_limit);
+    jk_buf_printf(&b, "\n%zu cells in use\n", jk_vm->heap.live);
+    jk_buf_flush(&b);
+    jk_buf_free(&b);
+}
 
-    input(input_buffer, sizeof(input_buffer), 0);
-    parser_set_text(parser, input_buffer);
-    //parser_set_text(parser, input);
+static const char *usage =
+    "usage: jiko [--image file] [--dump-image file] [file.jk [args]]\n"
+    "  --image file       start from an image instead of the standard library\n"
+    "  --dump-image file  write the definitions made by file.jk to an image\n";
 
+int main(int argc, char **argv) {
+    const char *image = NULL, *dump = NULL;
+    int arg = 1;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        if (arg + 1 < argc && strcmp(argv[arg], "--image") == 0)
+            image = argv[arg + 1];
+        else if (arg + 1 < argc && strcmp(argv[arg], "--dump-image") == 0)
+            dump = argv[arg + 1];
+        else {
+            fprintf(stderr, "%s", usage);
+            return 2;
+        }
+        arg += 2;
+    }
+    if (image) {
+        const char *error = jiko_init_image(image);
+        if (error) {
+            fprintf(stderr, "jiko: %s: %s\n", image, error);
+            return 1;
+        }
+    } else {
+        jiko_init();
+    }
+    /* JIKO_TRACE=<events> keeps the latest events and dumps them on error */
+    const char *trace = getenv("JIKO_TRACE");
+    if (trace)
+        jk_trace_enable(atol(trace), 1);
+    const char *limit = getenv("JIKO_PRINT_LIMIT");
+    if (limit)
+        print_limit = strtoul(limit, NULL, 10);
+    start_profile();
+    repl = arg == argc && !dump && isatty(STDIN_FILENO);
+    if (arg < argc || dump) {
+        jk_fiber_t *f = jk_fiber_new();
+        int status = 0;
+        if (arg < argc)
+            status = run_script(f, argv[arg], argc - arg - 1, argv + arg + 1);
+        if (status == 0 && dump) {
+            const char *error = jk_image_dump(f, dump);
+            if (error) {
+                fprintf(stderr, "jiko: %s: %s\n", dump, error);
+                status = 1;
+            }
+        }
+        jk_fiber_free(f);
+        finish_profile();
+        jiko_cleanup();
+        return status;
+    }
+    char *input_buffer = (char *)malloc(INPUT_CHUNK_SIZE);
+    if (!input_buffer)
+        jiko_panic("main: malloc failed");
+    parser_t *parser = parser_new();
     jk_fiber_t *f = jk_fiber_new();
-    while (1) {
-        jk_parse_result_t pr = parser_parse(parser);
+    int cont = 0, done = 0;
+
+    while (!done) {
+        size_t n = input(input_buffer, INPUT_CHUNK_SIZE, cont);
+        if (n)
+            parser_add(parser, input_buffer, n);
+        else
+            parser_finish(parser);
+        done = n == 0;
+        jk_parse_result_t pr;
+        while ((pr = parser_parse(parser)).type == JK_PARSE_OK)
+            jk_fiber_enqueue(f, pr.result.j);
         switch (pr.type) {
         case JK_PARSE_OK:
-            jk_parse_result_free(pr);
-            jk_fiber_enqueue(f, pr.result.j);
             break;
         case JK_PARSE_EOF_OK:
-            jk_parse_result_free(pr);
-            jk_fiber_eval(f, 1000);
-            jk_fiber_print(f);
-            jk_printf("\n");
-            jk_printf("%zu free objects\n", heap_free_objects_count());
-            if(!repl)
-                goto cleanup;
-            if(!input(input_buffer, sizeof(input_buffer), 0))
-                goto cleanup;
-            parser_set_text(parser, input_buffer);
-            break;
         case JK_PARSE_ERROR_EOF:
-            if(!repl) {
-                jk_printf(pr.result.error_msg);
-                jk_printf("\n");
+            /* complete forms are evaluated as they arrive, even when the
+               text ends inside a quotation: the parser keeps the open ones
+               alive. The fibers spawned by a line share its budget. */
+            run(f);
+            cont = pr.type == JK_PARSE_ERROR_EOF;
+            if (!repl && jk_error_raised(f)) {
+                done = 1; /* the rest of the input would not be run */
+            } else if (cont && done) {
+                jk_printf("%s\n", pr.result.error_msg);
                 jk_parse_result_free(pr);
                 goto cleanup;
-            } else {
-                if(!input(input_buffer, sizeof(input_buffer), 1)) {
-                    jk_printf(pr.result.error_msg);
-                    jk_printf("\n");
-                    jk_parse_result_free(pr);
-                    goto cleanup;
-                }
-                jk_parse_result_free(pr);
-                parser_add(parser, input_buffer);
+            } else if (repl && !done && !cont) {
+                print_state(f);
             }
             break;
         case JK_PARSE_ERROR_UNRECOVERABLE:
-            jk_printf(pr.result.error_msg);
-            jk_printf("\n");
+            jk_printf("%s\n", pr.result.error_msg);
             jk_parse_result_free(pr);
             goto cleanup;
-            break;
         }
+        jk_parse_result_free(pr);
+    }
+    if (!repl) {
+        jk_fiber_print(f);
+        jk_printf("\n");
     }
-    jk_fiber_eval(f, 1000);
-    jk_fiber_print(f);
 
 cleanup:
     jk_printf("cleanup...\n");
     jk_fiber_free(f);
     parser_free(parser);
+    free(input_buffer);
+    finish_profile();
     jiko_cleanup();
-}
\ No newline at end of file
+}
@@ -1,5 +1,9 @@
 #include "parser.h"
+#include "bigint.h"
 #include "heap.h"
+#include "str.h"
+#include "misc.h"
+#include "vm.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,28 +11,60 @@
 
 static void next(parser_t *p);
 
+static void parser_mark(void *data, void (*mark)(void *, jk_object_t),
+                        void *ctx) {
+    parser_t *p = (parser_t *)data;
+    for (size_t i = 0; i < p->depth; i++)
+        mark(ctx, p->open[i].head);
+}
+
 parser_t *parser_new() {
     parser_t *res = (parser_t*)malloc(sizeof(parser_t));
     assert(res);
     res->lexer = lexer_new();
-    res->look = NULL;
+    res->open = NULL;
+    res->depth = res->capacity = 0;
+    res->partial = 0;
+    res->root.mark = parser_mark;
+    res->root.data = res;
+    jk_gc_add_root(&res->root);
     next(res);
     return res;
 }
 
-void parser_add(parser_t *p, const char *text) {
-    lexer_add(p->lexer, text);
+/* The text before the lookahead is not needed anymore. The lookahead is
+   the only token lexed but not consumed yet: it is lexed again since the
+   new text may extend it. */
+void parser_add(parser_t *p, const char *text, size_t len) {
+    lexer_discard(p->lexer, p->look.offset);
+    lexer_add(p->lexer, text, len);
+    p->lexer->pos = 0;
+    p->partial = 1;
+    next(p);
+}
+
+void parser_finish(parser_t *p) {
+    p->partial = 0;
 }
 
 void parser_set_text(parser_t *p, const char *text) {
     lexer_set_text(p->lexer, text);
+    p->depth = 0;
+    p->partial = 0;
+    next(p);
+}
+
+void parser_set_view(parser_t *p, const char *text, size_t len) {
+    lexer_set_view(p->lexer, text, len);
+    p->depth = 0;
+    p->partial = 0;
     next(p);
 }
 
 void parser_free(parser_t *p) {
+    jk_gc_remove_root(&p->root);
     lexer_free(p->lexer);
-    if (p->look)
-        token_free(p->look);
+    free(p->open);
     free(p);
 }
 
@@ -36,35 +72,30 @@ static jk_parse_result_t jk_gen_parse_error(parser_t *p,
                                             enum jk_parse_result_type type,
                                             const char *msg) {
     jk_parse_result_t res;
+    unsigned int line, column;
     char *err = (char*)malloc(strlen(msg) + 1 + 64);
     assert(err);
-    sprintf(err, "%d:%d: %s", p->look->line, p->look->column, msg);
+    lexer_locate(p->lexer, p->look.offset, &line, &column);
+    sprintf(err, "%u:%u: %s", line, column, msg);
     res.type = type;
     res.result.error_msg = err;
     return res;
 }
 
 static void next(parser_t *p) {
-    if (p->look)
-        token_free(p->look);
     p->look = lexer_next(p->lexer);
 }
 
-static jk_parse_result_t integer(parser_t *p) {
-    jk_parse_result_t res;
-    res.type = JK_PARSE_OK;
-    res.result.j = jk_make_int(JK_INT_CTYPE_FROM_STRING(p->look->value));
-    next(p);
-    return res;
-}
-
-static char *jk_unescape_string(const char *str) {
-    char *res = (char*)malloc(strlen(str) + 1);
+/* str points to the len characters of a string token, quotes included */
+/* Stores the length of the result in *res_len */
+static char *jk_unescape_string(const char *str, size_t len, size_t *res_len) {
+    const char *end = str + len - 1;
+    char *res = (char*)malloc(len);
     char *ptr = res;
-    assert(*str == '"');
+    assert(res);
+    assert(len >= 2 && *str == '"' && *end == '"');
     str++;
-    while (*str != '"') {
-        assert(*str);
+    while (str < end) {
         if (*str == '\\') {
             str++;
             assert(*str);
@@ -93,111 +124,111 @@ static char *jk_unescape_string(const char *str) {
         }
         str++;
     }
-    assert(*++str == 0);
     *ptr = 0;
+    *res_len = (size_t)(ptr - res);
     return res;
 }
 
-static jk_parse_result_t string(parser_t *p) {
-    char *str = jk_unescape_string(p->look->value);
-    if (!str)
-        return jk_gen_parse_error(p, JK_PARSE_ERROR_UNRECOVERABLE,
-                                  "failed to unescape string");
-    jk_object_t j = jk_make_string(str);
-    jk_parse_result_t res;
-    res.type = JK_PARSE_OK;
-    res.result.j = j;
-    free(str);
-    next(p);
-    return res;
+static void open_quotation(parser_t *p) {
+    if (p->depth >= p->capacity) {
+        p->capacity = p->capacity ? p->capacity * 2 : 16;
+        p->open = (parser_frame_t *)realloc(
+            p->open, sizeof(parser_frame_t) * p->capacity);
+        if (!p->open)
+            jiko_panic("open_quotation: realloc failed");
+    }
+    p->open[p->depth].head = p->open[p->depth].tail = JK_NIL;
+    p->depth++;
 }
 
-static jk_parse_result_t word(parser_t *p) {
-    jk_parse_result_t res;
-    res.type = JK_PARSE_OK,
-    res.result.j = jk_make_word_from_string(p->look->value);
-    next(p);
-    return res;
+/* Inside a quotation or while more text may come, a token reaching the end
+   of the text may go on in text added later: words, integers and
+   unterminated strings */
+static int may_continue(parser_t *p) {
+    return (p->depth || p->partial) && p->look.type != TOK_STRING &&
+           p->look.offset + p->look.length == p->lexer->text_len;
 }
 
-static jk_parse_result_t quotation(parser_t *p) {
-    jk_object_t q = JK_NIL;
-    next(p); // we match the '['
+/* Iterative: nested quotations are kept on p->open with the tail of their
+   list, so each item is appended in constant time. When the text ends
+   inside a quotation, they are kept as they are and parsing resumes from
+   the lookahead once more text is added. */
+jk_parse_result_t parser_parse(parser_t *p) {
+    jk_parse_result_t res;
+    jk_object_t j;
+
     while (1) {
-        switch (p->look->type) {
+        switch (p->look.type) {
+        case TOK_INTEGER:
+            if (may_continue(p))
+                goto more;
+            j = jk_make_int_from_chars(lexer_token_text(p->lexer, p->look),
+                                       p->look.length);
+            break;
+        case TOK_STRING: {
+            size_t len;
+            char *str = jk_unescape_string(
+                lexer_token_text(p->lexer, p->look), p->look.length, &len);
+            if (!str)
+                return jk_gen_parse_error(p, JK_PARSE_ERROR_UNRECOVERABLE,
+                                          "failed to unescape string");
+            j = jk_make_string_chars(str, len);
+            free(str);
+            break;
+        }
+        case TOK_WORD:
+            if (may_continue(p))
+                goto more;
+            j = jk_make_word(word_from_chars(
+                lexer_token_text(p->lexer, p->look), p->look.length));
+            break;
+        case TOK_OPEN_BRACKET:
+            open_quotation(p);
+            next(p); // we match the '['
+            continue;
+        case TOK_CLOSE_BRACKET:
+            if (p->depth == 0)
+                return jk_gen_parse_error(p, JK_PARSE_ERROR_UNRECOVERABLE,
+                                          "parse error: unexpected ']'");
+            j = p->open[--p->depth].head;
+            break;
         case TOK_ERROR:
-            jk_object_free(q);
+            if (may_continue(p))
+                goto more;
+            p->depth = 0;
             return jk_gen_parse_error(p, JK_PARSE_ERROR_UNRECOVERABLE,
-                                      p->look->value);
+                                      p->look.error);
         case TOK_EOF:
-            jk_object_free(q);
-            return jk_gen_parse_error(p, JK_PARSE_ERROR_EOF,
-                                      "unexpected EOF inside quotation");
-        case TOK_CLOSE_BRACKET:
-            goto parsed;
-        default: {
-            jk_parse_result_t pr = parser_parse(p);
-            if (pr.type != JK_PARSE_OK) {
-                jk_object_free(q);
-                return pr;
-            }
-            q = jk_append(q, pr.result.j);
+            goto more;
+        default:
+            return jk_gen_parse_error(p, JK_PARSE_ERROR_UNRECOVERABLE,
+                                      "unreachable");
         }
+        next(p);
+        if (p->depth == 0) {
+            res.type = JK_PARSE_OK;
+            res.result.j = j;
+            return res;
         }
+        parser_frame_t *q = &p->open[p->depth - 1];
+        jk_object_t cell = jk_make_pair(j, JK_NIL);
+        if (q->head == JK_NIL)
+            q->head = cell;
+        else
+            CDR(q->tail) = cell;
+        q->tail = cell;
     }
-parsed:
-    next(p); // we match the ']'
-    jk_parse_result_t res;
-    res.type = JK_PARSE_OK;
-    res.result.j = q;
+more:
+    /* Recoverable errors (EOF inside quotation) only happen here */
+    if (p->depth)
+        return jk_gen_parse_error(p, JK_PARSE_ERROR_EOF,
+                                  "unexpected EOF inside quotation");
+    res.type = JK_PARSE_EOF_OK;
+    res.result.error_msg = NULL;
     return res;
 }
 
-jk_parse_result_t parser_parse(parser_t *p) {
-    jk_parse_result_t res;
-    lexer_t saved_lexer = *p->lexer;
-    token_t *saved_look = token_clone(p->look);
-
-    switch (p->look->type) {
-    case TOK_INTEGER:
-        token_free(saved_look);
-        return integer(p);
-    case TOK_STRING:
-        token_free(saved_look);
-        return string(p);
-    case TOK_WORD:
-        token_free(saved_look);
-        return word(p);
-    case TOK_OPEN_BRACKET:
-        res = quotation(p);
-        /* Recoverable errors (EOF inside quotation) only happen here */
-        if(res.type == JK_PARSE_ERROR_EOF) {
-            *p->lexer = saved_lexer;
-            token_free(p->look);
-            p->look = saved_look;
-        }
-        return res;
-    case TOK_CLOSE_BRACKET:
-        token_free(saved_look);
-        return jk_gen_parse_error(p, JK_PARSE_ERROR_UNRECOVERABLE,
-                                  "parse error: unexpected ']'");
-    case TOK_ERROR:
-        token_free(saved_look);
-        return jk_gen_parse_error(p, JK_PARSE_ERROR_UNRECOVERABLE,
-                                  p->look->value);
-    case TOK_EOF:
-        token_free(saved_look);
-        res.type = JK_PARSE_EOF_OK;
-        res.result.error_msg = NULL;
-        return res;
-    default:
-        token_free(saved_look);
-        return jk_gen_parse_error(p, JK_PARSE_ERROR_UNRECOVERABLE,
-                                  "unreachable");
-    }
-}
-
 void jk_parse_result_free(jk_parse_result_t pr) {
     if (pr.type != JK_PARSE_OK)
         free((void *)pr.result.error_msg);
-}
\ No newline at end of file
+}
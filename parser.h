@@ -1,3 +1,4 @@
+#include "heap.h"
 #include "lexer.h"
 #include "types.h"
 
@@ -16,14 +17,35 @@ typedef struct {
     } result;
 } jk_parse_result_t;
 
+/* A quotation being parsed: its list so far and the last cell of it */
+typedef struct parser_frame {
+    jk_object_t head, tail;
+} parser_frame_t;
+
+/* After JK_PARSE_ERROR_EOF, the lists of the open quotations are kept until
+   parsing resumes. They are garbage collector roots, so that the forms
+   parsed before them can run meanwhile. */
 typedef struct parser {
     lexer_t *lexer;
-    token_t *look;
+    token_t look;
+    parser_frame_t *open; /* innermost quotation last */
+    size_t depth, capacity;
+    int partial; /* text was added and the end of the input is unknown */
+    jk_gc_root_t root;
 } parser_t;
 
+/* The parser belongs to the current VM, and must be freed before it */
 parser_t *parser_new();
-void parser_add(parser_t *p, const char *text);
+/* Streams input: text goes on with len characters, which need not end on
+   a token boundary. Call parser_finish at the end of the input. */
+void parser_add(parser_t *p, const char *text, size_t len);
+void parser_finish(parser_t *p);
 void parser_set_text(parser_t *p, const char *text);
+/* Parses text in place, see lexer_set_view */
+void parser_set_view(parser_t *p, const char *text, size_t len);
 void parser_free(parser_t *);
+/* Parses the next top-level item. JK_PARSE_EOF_OK and JK_PARSE_ERROR_EOF
+   mean the text ended outside or inside a quotation: parsing resumes when
+   more text is added. */
 jk_parse_result_t parser_parse(parser_t *);
 void jk_parse_result_free(jk_parse_result_t);
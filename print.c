@@ -0,0 +1,337 @@
+#include "print.h"
+#include "bigint.h"
+#include "compile.h"
+#include "io.h"
+#include "misc.h"
+#include "str.h"
+#include "vector.h"
+#include "vm.h"
+#include "word_table.h"
+#include <assert.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* While a value is written with a limit, stop is the length of the buffer
+   at which it is cut: every append is clipped there and sets cut, and the
+   walks check cut to give up on the rest of the value. */
+
+#define BUF_MIN 256
+
+void jk_buf_init(jk_buf_t *b) {
+    b->data = (char *)malloc(BUF_MIN);
+    if (!b->data)
+        jiko_panic("jk_buf_init: malloc failed");
+    b->data[0] = 0;
+    b->len = 0;
+    b->capacity = BUF_MIN;
+    b->stop = 0;
+    b->cut = 0;
+}
+
+void jk_buf_free(jk_buf_t *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = b->capacity = 0;
+}
+
+/* Room for n more characters and the NUL */
+static void buf_reserve(jk_buf_t *b, size_t n) {
+    if (b->len + n < b->capacity)
+        return;
+    while (b->len + n >= b->capacity)
+        b->capacity *= 2;
+    b->data = (char *)realloc(b->data, b->capacity);
+    if (!b->data)
+        jiko_panic("buf_reserve: realloc failed");
+}
+
+/* Clips n to what the limit leaves */
+static size_t buf_room(jk_buf_t *b, size_t n) {
+    if (b->stop && n > b->stop - b->len) {
+        b->cut = 1;
+        return b->stop - b->len;
+    }
+    return n;
+}
+
+void jk_buf_put(jk_buf_t *b, const char *s, size_t n) {
+    n = buf_room(b, n);
+    buf_reserve(b, n);
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+    b->data[b->len] = 0;
+}
+
+void jk_buf_printf(jk_buf_t *b, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    assert(n >= 0);
+    buf_reserve(b, (size_t)n);
+    va_start(ap, fmt);
+    vsnprintf(b->data + b->len, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    b->len += buf_room(b, (size_t)n);
+    b->data[b->len] = 0;
+}
+
+static void put_str(jk_buf_t *b, const char *s) {
+    jk_buf_put(b, s, strlen(s));
+}
+
+static void put_int(jk_buf_t *b, int64_t i) {
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    uint64_t u = i < 0 ? -(uint64_t)i : (uint64_t)i;
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (i < 0)
+        *--p = '-';
+    jk_buf_put(b, p, (size_t)(digits + sizeof(digits) - p));
+}
+
+/* Quotes and escapes str the way the parser reads it back, copying the
+   runs of plain characters between escapes at once */
+static void put_escaped(jk_buf_t *b, const char *str, size_t len) {
+    size_t run = 0;
+    jk_buf_put(b, "\"", 1);
+    for (size_t i = 0; i < len && !b->cut; i++) {
+        const char *esc;
+        switch (str[i]) {
+        case '\n':
+            esc = "\\n";
+            break;
+        case '\r':
+            esc = "\\r";
+            break;
+        case '\t':
+            esc = "\\t";
+            break;
+        case '"':
+            esc = "\\\"";
+            break;
+        case '\\':
+            esc = "\\\\";
+            break;
+        default:
+            continue;
+        }
+        jk_buf_put(b, str + run, i - run);
+        jk_buf_put(b, esc, 2);
+        run = i + 1;
+    }
+    jk_buf_put(b, str + run, len - run);
+    jk_buf_put(b, "\"", 1);
+}
+
+/* Values other than quotations and errors */
+static void put_atom(jk_buf_t *b, jk_object_t j) {
+    switch (jk_get_type(j)) {
+    case JK_UNDEFINED:
+        assert(0 && "unreachable");
+        put_str(b, "<undefined>");
+        break;
+    case JK_INT:
+        put_int(b, AS_INT(j));
+        break;
+    case JK_BIGINT: {
+        char *digits = jk_bigint_to_string(AS_BIGINT(j));
+        put_str(b, digits);
+        free(digits);
+        break;
+    }
+    case JK_VECTOR: {
+        const jk_vector_t *v = AS_VECTOR(j);
+        put_str(b, "<vector");
+        for (size_t i = 0; i < v->len && !b->cut; i++) {
+            jk_buf_put(b, " ", 1);
+            put_int(b, v->items[i]);
+        }
+        jk_buf_put(b, ">", 1);
+        break;
+    }
+    case JK_BOOL:
+        put_str(b, AS_BOOL(j) ? "true" : "false");
+        break;
+    case JK_STRING:
+        put_escaped(b, jk_string_chars(j), jk_string_length(j));
+        break;
+    case JK_WORD:
+        put_str(b, word_to_string(AS_WORD(j)));
+        break;
+    case JK_NIL:
+        put_str(b, "[]");
+        break;
+    case JK_BUILTIN:
+        jk_buf_printf(b, "<builtin 0x%lx>", (intptr_t)AS_BUILTIN(j));
+        break;
+    case JK_FIBER:
+        jk_buf_printf(b, "<fiber 0x%lx>", (intptr_t)AS_FIBER(j));
+        break;
+    case JK_CHANNEL:
+        jk_buf_printf(b, "<chan 0x%lx>", (intptr_t)AS_CHAN(j));
+        break;
+    case JK_QUOTATION:
+    case JK_ERROR:
+        assert(0 && "unreachable");
+        break;
+    case JK_EOF:
+        break;
+    }
+}
+
+/* An open quotation and the rest of its items, or an error around the
+   value being written */
+typedef struct print_frame {
+    jk_object_t rest;
+    int error;
+} print_frame_t;
+
+typedef struct print_stack {
+    print_frame_t *items;
+    size_t size, capacity;
+} print_stack_t;
+
+static void print_push(print_stack_t *st, jk_object_t rest, int error) {
+    if (st->size >= st->capacity) {
+        st->capacity = st->capacity ? st->capacity * 2 : 16;
+        st->items = (print_frame_t *)realloc(
+            st->items, sizeof(print_frame_t) * st->capacity);
+        if (!st->items)
+            jiko_panic("print_push: realloc failed");
+    }
+    st->items[st->size].rest = rest;
+    st->items[st->size++].error = error;
+}
+
+/* Iterative, so that deeply nested values do not grow the C stack */
+static void put_object(jk_buf_t *b, jk_object_t j) {
+    print_stack_t st = {NULL, 0, 0};
+    while (!b->cut) {
+        if (jk_get_type(j) == JK_QUOTATION) {
+            jk_buf_put(b, "[", 1);
+            print_push(&st, CDR(j), 0);
+            j = CAR(j);
+            continue;
+        }
+        if (jk_get_type(j) == JK_ERROR) {
+            put_str(b, "<error ");
+            print_push(&st, JK_NIL, 1);
+            j = AS_ERROR(j);
+            continue;
+        }
+        put_atom(b, j);
+        /* closes what j ends, up to the next item to write */
+        while (st.size && !b->cut) {
+            print_frame_t *fr = &st.items[st.size - 1];
+            if (fr->error || fr->rest == JK_NIL) {
+                jk_buf_put(b, fr->error ? ">" : "]", 1);
+                st.size--;
+                continue;
+            }
+            jk_buf_put(b, " ", 1);
+            j = CAR(fr->rest);
+            fr->rest = CDR(fr->rest);
+            break;
+        }
+        if (!st.size)
+            break;
+    }
+    free(st.items);
+}
+
+/* The stack bottom first */
+static void put_stack(jk_buf_t *b, jk_stack_t *s) {
+    jk_buf_put(b, "[", 1);
+    for (size_t i = 0; i < s->size && !b->cut; i++) {
+        put_object(b, s->items[i]);
+        if (i + 1 < s->size)
+            jk_buf_put(b, " ", 1);
+    }
+    jk_buf_put(b, "]", 1);
+}
+
+/* The items left in the frames, innermost first, then the queue, as one
+   flat list */
+static void put_queue(jk_buf_t *b, jk_fiber_t *f) {
+    const char *sep = "";
+    jk_buf_put(b, "[", 1);
+    for (size_t i = f->frames.size; i-- > 0 && !b->cut;) {
+        jk_frame_t *fr = &f->frames.items[i];
+        for (size_t ip = fr->ip; ip < fr->code->len && !b->cut; ip++) {
+            put_str(b, sep);
+            put_object(b, fr->code->insns[ip].obj);
+            sep = " ";
+        }
+    }
+    for (jk_object_t ji = f->queue; ji != JK_NIL && !b->cut; ji = CDR(ji)) {
+        put_str(b, sep);
+        put_object(b, CAR(ji));
+        sep = " ";
+    }
+    jk_buf_put(b, "]", 1);
+}
+
+static void limit_begin(jk_buf_t *b, size_t limit) {
+    b->stop = limit && limit <= SIZE_MAX - b->len ? b->len + limit : 0;
+    b->cut = 0;
+}
+
+static void limit_end(jk_buf_t *b) {
+    b->stop = 0;
+    if (b->cut)
+        jk_buf_put(b, "...", 3);
+    b->cut = 0;
+}
+
+void jk_buf_object(jk_buf_t *b, jk_object_t j, size_t limit) {
+    limit_begin(b, limit);
+    put_object(b, j);
+    limit_end(b);
+}
+
+void jk_buf_fiber(jk_buf_t *b, jk_fiber_t *f, size_t limit) {
+    limit_begin(b, limit);
+    put_stack(b, &f->stack);
+    jk_buf_put(b, " : ", 3);
+    put_queue(b, f);
+    limit_end(b);
+}
+
+void jk_buf_flush(jk_buf_t *b) {
+    if (b->len)
+        jk_printf("%s", b->data);
+    b->len = 0;
+    b->data[0] = 0;
+}
+
+char *jk_to_string(jk_object_t j, size_t limit) {
+    jk_buf_t b;
+    jk_buf_init(&b);
+    jk_buf_object(&b, j, limit);
+    return b.data;
+}
+
+void jk_print_object(jk_object_t j) {
+    jk_buf_t b;
+    jk_buf_init(&b);
+    jk_buf_object(&b, j, 0);
+    jk_buf_flush(&b);
+    jk_buf_free(&b);
+}
+
+void jk_fiber_print(jk_fiber_t *f) {
+    jk_buf_t b;
+    jk_buf_init(&b);
+    jk_buf_fiber(&b, f, 0);
+    jk_buf_flush(&b);
+    jk_buf_free(&b);
+}
+
+#undef BUF_MIN
@@ -0,0 +1,34 @@
+#ifndef PRINT_H
+#define PRINT_H
+
+#include "types.h"
+#include <stddef.h>
+
+/* Text is built in a growable buffer, then written with a single call to
+   jk_printf, instead of a call for every bracket, space and element. */
+
+typedef struct jk_buf {
+    char *data; /* NUL terminated */
+    size_t len, capacity;
+    size_t stop; /* length at which the value being written is cut, or 0 */
+    int cut;
+} jk_buf_t;
+
+void jk_buf_init(jk_buf_t *b);
+void jk_buf_free(jk_buf_t *b);
+void jk_buf_put(jk_buf_t *b, const char *s, size_t n);
+void jk_buf_printf(jk_buf_t *b, const char *fmt, ...);
+/* Appends j as print shows it. With a limit other than 0, no more than
+   limit bytes of it are kept, followed by "..." if j did not fit: the
+   walk stops there, so a huge value costs what is kept of it. */
+void jk_buf_object(jk_buf_t *b, jk_object_t j, size_t limit);
+/* Appends the stack of f, then the input left to it, with a limit for
+   both as above */
+void jk_buf_fiber(jk_buf_t *b, jk_fiber_t *f, size_t limit);
+/* Writes the content of b with jk_printf, and empties it */
+void jk_buf_flush(jk_buf_t *b);
+
+/* j as jk_buf_object writes it, allocated with malloc */
+char *jk_to_string(jk_object_t j, size_t limit);
+
+#endif
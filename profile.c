@@ -0,0 +1,257 @@
+#include "profile.h"
+#include "misc.h"
+#include "vm.h"
+#include "word_table.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* The stacks sampled are interned in an open addressing table, their words
+   kept in one pool. Direct recursion is folded: a word calling itself
+   appears once in the stack recorded, so that a deep recursion does not
+   make a new stack at each depth. */
+
+typedef struct jk_profile_stack {
+    uint64_t hash;
+    size_t offset, len; /* in the pool */
+    uint64_t steps;     /* 0 for an empty slot */
+} jk_profile_stack_t;
+
+static uint64_t now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+}
+
+/* Instructions retired by the calling thread, in user space */
+static int perf_open() {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static uint64_t perf_read(int fd) {
+    uint64_t value = 0;
+#ifdef __linux__
+    if (read(fd, &value, sizeof(value)) != (ssize_t)sizeof(value))
+        value = 0;
+#else
+    (void)fd;
+#endif
+    return value;
+}
+
+int jk_profile_enable(unsigned long period, int by_time, int perf) {
+    jk_profile_t *p = &jk_vm->profile;
+    jk_profile_disable();
+    p->period = period ? period : 1;
+    p->by_time = by_time;
+    p->countdown = by_time ? JK_PROFILE_POLL : p->period;
+    p->perf_fd = perf ? perf_open() : -1;
+    p->last_ns = now_ns();
+    p->last_events = p->perf_fd >= 0 ? perf_read(p->perf_fd) : 0;
+    return !perf || p->perf_fd >= 0;
+}
+
+void jk_profile_disable() {
+    jk_profile_t *p = &jk_vm->profile;
+#ifdef __linux__
+    if (p->perf_fd >= 0)
+        close(p->perf_fd);
+#endif
+    free(p->words);
+    free(p->stacks);
+    free(p->pool);
+    memset(p, 0, sizeof(*p));
+    p->perf_fd = -1;
+}
+
+static jk_profile_word_t *profile_word(jk_profile_t *p, word_t w) {
+    if (w >= p->words_size) {
+        size_t size = p->words_size ? p->words_size : 256;
+        while (size <= w)
+            size *= 2;
+        p->words = (jk_profile_word_t *)realloc(
+            p->words, sizeof(jk_profile_word_t) * size);
+        if (!p->words)
+            jiko_panic("profile_word: realloc failed");
+        memset(&p->words[p->words_size], 0,
+               sizeof(jk_profile_word_t) * (size - p->words_size));
+        p->words_size = size;
+    }
+    return &p->words[w];
+}
+
+static void pool_push(jk_profile_t *p, word_t w) {
+    if (p->pool_size >= p->pool_capacity) {
+        p->pool_capacity = p->pool_capacity ? p->pool_capacity * 2 : 1024;
+        p->pool = (word_t *)realloc(p->pool, sizeof(word_t) * p->pool_capacity);
+        if (!p->pool)
+            jiko_panic("pool_push: realloc failed");
+    }
+    p->pool[p->pool_size++] = w;
+}
+
+static void stacks_grow(jk_profile_t *p) {
+    size_t size = p->stacks_size ? p->stacks_size * 2 : 256;
+    jk_profile_stack_t *stacks =
+        (jk_profile_stack_t *)calloc(size, sizeof(jk_profile_stack_t));
+    if (!stacks)
+        jiko_panic("stacks_grow: calloc failed");
+    for (size_t i = 0; i < p->stacks_size; i++) {
+        jk_profile_stack_t *s = &p->stacks[i];
+        size_t j = (size_t)s->hash & (size - 1);
+        if (!s->steps)
+            continue;
+        while (stacks[j].steps)
+            j = (j + 1) & (size - 1);
+        stacks[j] = *s;
+    }
+    free(p->stacks);
+    p->stacks = stacks;
+    p->stacks_size = size;
+}
+
+/* Adds steps to the stack at the end of the pool from offset on, which is
+   kept in the pool only if it is new */
+static void record_stack(jk_profile_t *p, size_t offset, uint64_t steps) {
+    size_t len = p->pool_size - offset;
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ p->pool[offset + i]) * 1099511628211u;
+    if (2 * (p->stacks_count + 1) > p->stacks_size)
+        stacks_grow(p);
+    size_t j = (size_t)hash & (p->stacks_size - 1);
+    for (; p->stacks[j].steps; j = (j + 1) & (p->stacks_size - 1)) {
+        jk_profile_stack_t *s = &p->stacks[j];
+        if (s->hash == hash && s->len == len &&
+            (len == 0 || memcmp(&p->pool[s->offset], &p->pool[offset],
+                                sizeof(word_t) * len) == 0)) {
+            s->steps += steps;
+            p->pool_size = offset;
+            return;
+        }
+    }
+    p->stacks[j].hash = hash;
+    p->stacks[j].offset = offset;
+    p->stacks[j].len = len;
+    p->stacks[j].steps = steps;
+    p->stacks_count++;
+}
+
+static void sample(jk_profile_t *p, jk_fiber_t *f, uint64_t now) {
+    uint64_t steps = p->steps, ns = now - p->last_ns, events = 0;
+    size_t offset = p->pool_size;
+    if (p->perf_fd >= 0) {
+        uint64_t count = perf_read(p->perf_fd);
+        events = count - p->last_events;
+        p->last_events = count;
+    }
+    p->last_ns = now;
+    p->steps = 0;
+    p->samples++;
+
+    for (size_t i = 0; i < f->frames.size; i++) {
+        word_t w = f->frames.items[i].word;
+        if (w == JK_TRACE_NO_WORD ||
+            (p->pool_size > offset && p->pool[p->pool_size - 1] == w))
+            continue;
+        pool_push(p, w);
+        /* a word met twice in the stack is counted once */
+        jk_profile_word_t *pw = profile_word(p, w);
+        if (pw->stamp != p->samples) {
+            pw->stamp = p->samples;
+            pw->steps += steps;
+            pw->ns += ns;
+            pw->events += events;
+        }
+    }
+    if (p->pool_size > offset) {
+        jk_profile_word_t *pw = profile_word(p, p->pool[p->pool_size - 1]);
+        pw->self_steps += steps;
+        pw->self_ns += ns;
+        pw->self_events += events;
+    }
+    record_stack(p, offset, steps);
+}
+
+void jk_profile_poll(jk_fiber_t *f) {
+    jk_profile_t *p = &jk_vm->profile;
+    if (!p->by_time) {
+        p->steps += p->period;
+        p->countdown = p->period;
+        sample(p, f, now_ns());
+        return;
+    }
+    p->steps += JK_PROFILE_POLL;
+    p->countdown = JK_PROFILE_POLL;
+    uint64_t now = now_ns();
+    if (now - p->last_ns >= p->period)
+        sample(p, f, now);
+}
+
+void jk_profile_write_folded(FILE *out) {
+    jk_profile_t *p = &jk_vm->profile;
+    for (size_t i = 0; i < p->stacks_size; i++) {
+        jk_profile_stack_t *s = &p->stacks[i];
+        if (!s->steps)
+            continue;
+        if (s->len == 0)
+            fputs("[toplevel]", out);
+        for (size_t k = 0; k < s->len; k++)
+            fprintf(out, "%s%s", k ? ";" : "",
+                    word_to_string(p->pool[s->offset + k]));
+        fprintf(out, " %llu\n", (unsigned long long)s->steps);
+    }
+}
+
+static int compare_words(const void *a, const void *b) {
+    const jk_profile_word_t *words = jk_vm->profile.words;
+    uint64_t x = words[*(const word_t *)a].steps;
+    uint64_t y = words[*(const word_t *)b].steps;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void jk_profile_write_words(FILE *out) {
+    jk_profile_t *p = &jk_vm->profile;
+    word_t *order = (word_t *)malloc(sizeof(word_t) * (p->words_size + 1));
+    size_t n = 0;
+    if (!order)
+        jiko_panic("jk_profile_write_words: malloc failed");
+    for (word_t w = 0; w < p->words_size; w++)
+        if (p->words[w].steps)
+            order[n++] = w;
+    qsort(order, n, sizeof(word_t), compare_words);
+    fprintf(out, "%-24s %14s %14s %12s %12s", "word", "steps", "self steps",
+            "ms", "self ms");
+    if (p->perf_fd >= 0)
+        fprintf(out, " %16s %16s", "instructions", "self instr.");
+    fprintf(out, "\n");
+    for (size_t i = 0; i < n; i++) {
+        jk_profile_word_t *pw = &p->words[order[i]];
+        fprintf(out, "%-24s %14llu %14llu %12.3f %12.3f",
+                word_to_string(order[i]), (unsigned long long)pw->steps,
+                (unsigned long long)pw->self_steps, pw->ns / 1e6,
+                pw->self_ns / 1e6);
+        if (p->perf_fd >= 0)
+            fprintf(out, " %16llu %16llu", (unsigned long long)pw->events,
+                    (unsigned long long)pw->self_events);
+        fprintf(out, "\n");
+    }
+    free(order);
+}
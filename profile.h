@@ -0,0 +1,66 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "trace.h"
+#include "types.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Sampling profiler. Every period steps, or every period nanoseconds, the
+   evaluator takes a sample of the words being run by the current fiber:
+   the words whose call left a frame, outermost first. Since a tail call
+   replaces the frame of its caller, so does its word. Each sample charges
+   the steps and time elapsed since the previous one, and the hardware
+   events counted through perf_event_open when asked, to the stack
+   sampled: inclusively to each word in it, and as self cost to the
+   innermost one. When disabled, a step only tests
+   jk_vm->profile.countdown. */
+
+typedef struct jk_profile_word {
+    uint64_t steps, self_steps;
+    uint64_t ns, self_ns;
+    uint64_t events, self_events;
+    unsigned long stamp; /* last sample counted in the inclusive costs */
+} jk_profile_word_t;
+
+/* Profile of a VM, see profile.c */
+typedef struct jk_profile {
+    unsigned long countdown; /* steps before the next poll, 0 if disabled */
+    unsigned long period;
+    int by_time; /* period in nanoseconds, polled every JK_PROFILE_POLL */
+    unsigned long samples;
+    uint64_t steps; /* since the last sample */
+    uint64_t last_ns, last_events;
+    int perf_fd;
+    jk_profile_word_t *words; /* indexed by word */
+    size_t words_size;
+    struct jk_profile_stack *stacks; /* hash table of the stacks sampled */
+    size_t stacks_size, stacks_count;
+    word_t *pool; /* words of the stacks sampled */
+    size_t pool_size, pool_capacity;
+} jk_profile_t;
+
+#define JK_PROFILE_POLL 64
+
+#define JK_PROFILE(f)                                                          \
+    do {                                                                       \
+        if (JK_UNLIKELY(jk_vm->profile.countdown) &&                           \
+            --jk_vm->profile.countdown == 0)                                   \
+            jk_profile_poll(f);                                                \
+    } while (0)
+
+/* Starts profiling the current VM, every period steps or, with by_time,
+   every period nanoseconds. With perf, the instructions retired are
+   counted too: returns 0 if perf_event_open is not available, in which
+   case profiling goes on without them. */
+int jk_profile_enable(unsigned long period, int by_time, int perf);
+void jk_profile_disable();
+void jk_profile_poll(jk_fiber_t *f);
+/* Writes one line per stack sampled, "outer;inner steps", as read by
+   flame graph tools */
+void jk_profile_write_folded(FILE *out);
+/* Writes the costs of each word sampled, highest inclusive steps first */
+void jk_profile_write_words(FILE *out);
+
+#endif
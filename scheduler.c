@@ -0,0 +1,111 @@
+#include "scheduler.h"
+#include "eval.h"
+#include "types.h"
+#include "vm.h"
+#include <assert.h>
+#include <stddef.h>
+
+static void queue_push(jk_fiber_queue_t *q, jk_fiber_t *f) {
+    f->sched_next = NULL;
+    if (q->tail)
+        q->tail->sched_next = f;
+    else
+        q->head = f;
+    q->tail = f;
+}
+
+static jk_fiber_t *queue_pop(jk_fiber_queue_t *q) {
+    jk_fiber_t *f = q->head;
+    q->head = f->sched_next;
+    if (!q->head)
+        q->tail = NULL;
+    f->sched_next = NULL;
+    return f;
+}
+
+static void queue_unlink(jk_fiber_queue_t *q, jk_fiber_t *f) {
+    jk_fiber_t *prev = NULL;
+    for (jk_fiber_t *g = q->head; g; prev = g, g = g->sched_next) {
+        if (g != f)
+            continue;
+        if (prev)
+            prev->sched_next = g->sched_next;
+        else
+            q->head = g->sched_next;
+        if (q->tail == g)
+            q->tail = prev;
+        return;
+    }
+    assert(0 && "queue_unlink: not found");
+}
+
+void jk_sched_add(jk_fiber_t *f) {
+    if (f->state != JK_FIBER_IDLE)
+        return;
+    f->state = JK_FIBER_READY;
+    queue_push(&jk_vm->sched.run, f);
+}
+
+int jk_sched_wake(jk_fiber_queue_t *q) {
+    if (!q->head)
+        return 0;
+    jk_fiber_t *f = queue_pop(q);
+    f->waiting = NULL;
+    f->joining = NULL;
+    f->state = JK_FIBER_IDLE;
+    jk_sched_add(f);
+    return 1;
+}
+
+void jk_sched_remove(jk_fiber_t *f) {
+    assert(f->state != JK_FIBER_RUNNING);
+    if (f->state == JK_FIBER_READY)
+        queue_unlink(&jk_vm->sched.run, f);
+    else if (f->state == JK_FIBER_BLOCKED)
+        queue_unlink(f->waiting, f);
+    f->state = JK_FIBER_IDLE;
+    f->waiting = NULL;
+    f->joining = NULL;
+    while (jk_sched_wake(&f->joiners))
+        ;
+}
+
+void jk_sched_wait(jk_fiber_t *f, jk_fiber_queue_t *q) {
+    f->state = JK_FIBER_BLOCKED;
+    f->waiting = q;
+    queue_push(q, f);
+    f->suspend = 1;
+}
+
+int jk_sched_block(jk_fiber_t *f, jk_fiber_t *t) {
+    for (jk_fiber_t *g = t; g; g = g->joining)
+        if (g == f)
+            return 0;
+    jk_sched_wait(f, &t->joiners);
+    f->joining = t;
+    return 1;
+}
+
+static int fiber_done(jk_fiber_t *f) {
+    return jk_error_raised(f) ||
+           (f->frames.size == 0 && f->queue == JK_NIL);
+}
+
+size_t jk_sched_run(size_t budget) {
+    jk_fiber_queue_t *run = &jk_vm->sched.run;
+    while (run->head && budget) {
+        jk_fiber_t *f = queue_pop(run);
+        size_t slice = budget < JK_SCHED_SLICE ? budget : JK_SCHED_SLICE;
+        f->state = JK_FIBER_RUNNING;
+        budget -= slice - jk_fiber_eval(f, slice);
+        if (f->state == JK_FIBER_BLOCKED)
+            continue;
+        f->state = JK_FIBER_IDLE;
+        if (fiber_done(f))
+            while (jk_sched_wake(&f->joiners))
+                ;
+        else
+            jk_sched_add(f);
+    }
+    return budget;
+}
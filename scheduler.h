@@ -0,0 +1,35 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "types.h"
+#include <stddef.h>
+
+/* Cooperative scheduler. Ready fibers wait in a FIFO run queue and run in
+   turn for a time slice of at most JK_SCHED_SLICE steps. A fiber leaves
+   the queue when it is done (no frame nor input left, or an error raised),
+   or when it blocks in a wait queue, until it is woken up: the joiners of
+   a fiber are woken when it is done, channels keep queues of the fibers
+   waiting to send or receive. */
+
+#define JK_SCHED_SLICE 256
+
+typedef struct jk_sched {
+    jk_fiber_queue_t run;
+} jk_sched_t;
+
+/* Makes f ready, unless it is already scheduled */
+void jk_sched_add(jk_fiber_t *f);
+/* Takes f out of the scheduler and wakes the fibers blocked on it */
+void jk_sched_remove(jk_fiber_t *f);
+/* Blocks f in q and ends its slice */
+void jk_sched_wait(jk_fiber_t *f, jk_fiber_queue_t *q);
+/* Makes the first fiber of q ready. Returns 0 if q is empty. */
+int jk_sched_wake(jk_fiber_queue_t *q);
+/* Blocks f until t is done and ends the slice of f. Returns 0, without
+   blocking, if t is already joining f. */
+int jk_sched_block(jk_fiber_t *f, jk_fiber_t *t);
+/* Runs ready fibers for at most budget steps in total. Returns the steps
+   left, which are only non zero when no fiber is ready anymore. */
+size_t jk_sched_run(size_t budget);
+
+#endif
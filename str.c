@@ -0,0 +1,226 @@
+#include "str.h"
+#include "heap.h"
+#include "misc.h"
+#include "vm.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Concatenations shorter than ROPE_MIN are copied into a flat string: a
+   rope node only pays off when it saves copying more than its own size.
+   Ropes are flattened and released without recursion, since building a
+   string piece by piece makes them as deep as the number of pieces. The
+   characters of flat strings are counted in heap.string_bytes. */
+
+#define ROPE_MIN 64
+
+#define IS_INLINE(j) (JK_CELL(j).code != 0)
+
+static jk_string_t *string_alloc(size_t len) {
+    jk_string_t *s = (jk_string_t *)malloc(sizeof(jk_string_t) + len + 1);
+    if (!s)
+        jiko_panic("string_alloc: malloc failed");
+    s->refs = 1;
+    s->len = len;
+    s->hash = 0;
+    s->left = s->right = NULL;
+    s->chars[len] = 0;
+    jk_vm->heap.string_bytes += len + 1;
+    return s;
+}
+
+/* Stack of the nodes a rope walk has still to visit */
+typedef struct node_stack {
+    jk_string_t **items;
+    size_t size, capacity;
+} node_stack_t;
+
+static void node_push(node_stack_t *st, jk_string_t *s) {
+    if (st->size >= st->capacity) {
+        st->capacity = st->capacity ? st->capacity * 2 : 16;
+        st->items = (jk_string_t **)realloc(
+            st->items, sizeof(jk_string_t *) * st->capacity);
+        if (!st->items)
+            jiko_panic("node_push: realloc failed");
+    }
+    st->items[st->size++] = s;
+}
+
+void jk_string_release(jk_string_t *s) {
+    node_stack_t st = {NULL, 0, 0};
+    while (s) {
+        if (--s->refs == 0) {
+            if (s->right)
+                node_push(&st, s->right);
+            if (s->left)
+                node_push(&st, s->left);
+            else
+                jk_vm->heap.string_bytes -= s->len + 1;
+            free(s);
+        }
+        s = st.size ? st.items[--st.size] : NULL;
+    }
+    free(st.items);
+}
+
+/* Copies the leaves of the rope s into a flat string, right to left */
+static void flatten(jk_string_t *s) {
+    node_stack_t st = {NULL, 0, 0};
+    jk_string_t *flat = string_alloc(s->len);
+    size_t end = s->len;
+    node_push(&st, s);
+    while (st.size) {
+        jk_string_t *n = st.items[--st.size];
+        if (n->right) {
+            node_push(&st, n->left);
+            node_push(&st, n->right);
+            continue;
+        }
+        end -= n->len;
+        memcpy(flat->chars + end, n->left ? n->left->chars : n->chars,
+               n->len);
+    }
+    free(st.items);
+    assert(end == 0);
+    flat->hash = s->hash;
+    jk_string_release(s->left);
+    jk_string_release(s->right);
+    s->left = flat;
+    s->right = NULL;
+}
+
+static const char *string_chars(jk_string_t *s) {
+    if (s->right)
+        flatten(s);
+    return s->left ? s->left->chars : s->chars;
+}
+
+/* String cells **************************************************************/
+
+void jk_string_init(jk_object_t j, const char *chars, size_t len) {
+    if (len <= JK_STRING_INLINE_MAX) {
+        memset(JK_CELL(j).value.as_chars, 0,
+               sizeof(JK_CELL(j).value.as_chars));
+        memcpy(JK_CELL(j).value.as_chars, chars, len);
+        JK_CELL(j).code = (int)len + 1;
+        return;
+    }
+    jk_string_t *s = string_alloc(len);
+    memcpy(s->chars, chars, len);
+    JK_CELL(j).code = 0;
+    JK_CELL(j).value.as_string = s;
+}
+
+/* Takes the reference s */
+static jk_object_t make_string(jk_string_t *s) {
+    jk_object_t res = jk_object_alloc();
+    jk_set_type(res, JK_STRING);
+    JK_CELL(res).code = 0;
+    JK_CELL(res).value.as_string = s;
+    return res;
+}
+
+jk_object_t jk_make_string_chars(const char *chars, size_t len) {
+    jk_object_t res = jk_object_alloc();
+    jk_set_type(res, JK_STRING);
+    jk_string_init(res, chars, len);
+    return res;
+}
+
+jk_object_t jk_make_string(const char *str) {
+    return jk_make_string_chars(str, strlen(str));
+}
+
+void jk_string_finalize(jk_object_t j) {
+    if (!IS_INLINE(j))
+        jk_string_release(JK_CELL(j).value.as_string);
+}
+
+const char *jk_string_chars(jk_object_t j) {
+    if (IS_INLINE(j))
+        return JK_CELL(j).value.as_chars;
+    return string_chars(JK_CELL(j).value.as_string);
+}
+
+size_t jk_string_length(jk_object_t j) {
+    if (IS_INLINE(j))
+        return (size_t)JK_CELL(j).code - 1;
+    return JK_CELL(j).value.as_string->len;
+}
+
+/* FNV-1a, never 0 */
+static uint64_t fnv1a(const char *chars, size_t len) {
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)chars[i]) * 1099511628211u;
+    return hash ? hash : 1;
+}
+
+uint64_t jk_string_hash(jk_object_t j) {
+    if (IS_INLINE(j))
+        return fnv1a(JK_CELL(j).value.as_chars, jk_string_length(j));
+    jk_string_t *s = JK_CELL(j).value.as_string;
+    if (!s->hash)
+        s->hash = fnv1a(string_chars(s), s->len);
+    return s->hash;
+}
+
+int jk_string_equal(jk_object_t a, jk_object_t b) {
+    size_t len = jk_string_length(a);
+    if (len != jk_string_length(b))
+        return 0;
+    /* strings of the same length are both inline or both not */
+    if (!IS_INLINE(a) &&
+        JK_CELL(a).value.as_string == JK_CELL(b).value.as_string)
+        return 1;
+    if (jk_string_hash(a) != jk_string_hash(b))
+        return 0;
+    return memcmp(jk_string_chars(a), jk_string_chars(b), len) == 0;
+}
+
+/* A reference to the characters of j, copied out of the cell if inline */
+static jk_string_t *string_ref(jk_object_t j) {
+    jk_string_t *s;
+    if (IS_INLINE(j)) {
+        s = string_alloc(jk_string_length(j));
+        memcpy(s->chars, JK_CELL(j).value.as_chars, s->len);
+        return s;
+    }
+    s = JK_CELL(j).value.as_string;
+    s->refs++;
+    return s;
+}
+
+jk_object_t jk_string_concat(jk_object_t a, jk_object_t b) {
+    size_t la = jk_string_length(a), lb = jk_string_length(b);
+    if (la == 0)
+        return b;
+    if (lb == 0)
+        return a;
+    if (la + lb < ROPE_MIN) {
+        /* short strings are never ropes */
+        char chars[ROPE_MIN];
+        memcpy(chars, jk_string_chars(a), la);
+        memcpy(chars + la, jk_string_chars(b), lb);
+        return jk_make_string_chars(chars, la + lb);
+    }
+    jk_string_t *s = (jk_string_t *)malloc(sizeof(jk_string_t));
+    if (!s)
+        jiko_panic("jk_string_concat: malloc failed");
+    s->refs = 1;
+    s->len = la + lb;
+    s->hash = 0;
+    s->left = string_ref(a);
+    s->right = string_ref(b);
+    return make_string(s);
+}
+
+jk_object_t jk_string_slice(jk_object_t j, size_t start, size_t end) {
+    assert(start <= end && end <= jk_string_length(j));
+    if (start == 0 && end == jk_string_length(j))
+        return j;
+    return jk_make_string_chars(jk_string_chars(j) + start, end - start);
+}
+
+#undef ROPE_MIN
+#undef IS_INLINE
@@ -0,0 +1,51 @@
+#ifndef STR_H
+#define STR_H
+
+#include "types.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Strings are immutable and counted in bytes, with no NUL inside. Up to
+   JK_STRING_INLINE_MAX of them are held in the value of their JK_STRING
+   cell, whose code is then 1 + their length. A longer string points to a
+   jk_string_t instead, shared by reference counting between its cell and
+   the rope nodes made from it.
+
+   Concatenating strings into a long one makes a rope node holding both
+   halves, so that building a string piece by piece does not copy it at
+   each step: the node is flattened the first time its characters are
+   needed. Strings belong to the VM that made them, channels copy their
+   characters. */
+
+#define JK_STRING_INLINE_MAX                                                   \
+    (sizeof(((struct jk_object *)0)->value.as_chars) - 1)
+
+typedef struct jk_string {
+    unsigned long refs;
+    size_t len;
+    uint64_t hash; /* of the characters, 0 until needed */
+    /* Halves of a rope node, NULL for a flat string. Once flattened, a
+       node keeps the flat string in left, and right is NULL. */
+    struct jk_string *left, *right;
+    char chars[]; /* len + 1 NUL terminated, in a flat string only */
+} jk_string_t;
+
+void jk_string_release(jk_string_t *s);
+
+/* Copies the len characters of chars */
+jk_object_t jk_make_string_chars(const char *chars, size_t len);
+/* Makes j, an allocated cell whose type is set apart, a string */
+void jk_string_init(jk_object_t j, const char *chars, size_t len);
+/* Drops the reference held by the cell j */
+void jk_string_finalize(jk_object_t j);
+
+/* NUL terminated characters of j, which stay valid as long as j does */
+const char *jk_string_chars(jk_object_t j);
+size_t jk_string_length(jk_object_t j);
+uint64_t jk_string_hash(jk_object_t j);
+int jk_string_equal(jk_object_t a, jk_object_t b);
+jk_object_t jk_string_concat(jk_object_t a, jk_object_t b);
+/* Characters from start to end, 0 <= start <= end <= length */
+jk_object_t jk_string_slice(jk_object_t j, size_t start, size_t end);
+
+#endif
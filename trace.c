@@ -0,0 +1,72 @@
+#include "trace.h"
+#include "heap.h"
+#include "io.h"
+#include "misc.h"
+#include "vm.h"
+#include "word_table.h"
+#include <stdlib.h>
+
+void jk_trace_enable(size_t capacity, int dump_on_error) {
+    jk_trace_t *t = &jk_vm->trace;
+    size_t size = 1;
+    while (size < capacity)
+        size *= 2;
+    free(t->ring);
+    t->ring = (jk_trace_event_t *)malloc(sizeof(jk_trace_event_t) * size);
+    if (!t->ring)
+        jiko_panic("jk_trace_enable: malloc failed");
+    t->mask = size - 1;
+    t->step = 0;
+    t->dump_on_error = dump_on_error;
+    t->enabled = 1;
+}
+
+void jk_trace_disable() {
+    jk_trace_t *t = &jk_vm->trace;
+    t->enabled = 0;
+    free(t->ring);
+    t->ring = NULL;
+    t->mask = 0;
+}
+
+void jk_trace_record(jk_fiber_t *f, word_t w) {
+    jk_trace_t *t = &jk_vm->trace;
+    jk_trace_event_t *e = &t->ring[t->step & t->mask];
+    e->step = t->step++;
+    e->word = w;
+    e->depth = (unsigned int)f->stack.size;
+    e->cells = (unsigned long)jk_vm->heap.allocated;
+}
+
+size_t jk_trace_snapshot(jk_trace_event_t *out, size_t max) {
+    jk_trace_t *t = &jk_vm->trace;
+    size_t n = t->step < t->mask + 1 ? t->step : t->mask + 1;
+    if (!t->ring)
+        return 0;
+    if (n > max)
+        n = max;
+    for (size_t i = 0; i < n; i++)
+        out[i] = t->ring[(t->step - n + i) & t->mask];
+    return n;
+}
+
+void jk_trace_dump() {
+    jk_trace_t *t = &jk_vm->trace;
+    size_t n = t->step < t->mask + 1 ? t->step : t->mask + 1;
+    if (!t->ring)
+        return;
+    jk_printf("trace: last %zu of %lu steps\n", n, t->step);
+    for (size_t i = 0; i < n; i++) {
+        jk_trace_event_t *e = &t->ring[(t->step - n + i) & t->mask];
+        jk_printf("%10lu depth %5u cells %10lu", e->step, e->depth, e->cells);
+        if (e->word != JK_TRACE_NO_WORD)
+            jk_printf(" %s", word_to_string(e->word));
+        jk_printf("\n");
+    }
+}
+
+void jk_trace_error() {
+    jk_trace_t *t = &jk_vm->trace;
+    if (t->enabled && t->dump_on_error)
+        jk_trace_dump();
+}
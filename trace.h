@@ -0,0 +1,52 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "types.h"
+#include <stddef.h>
+
+/* Execution tracing. When enabled, every evaluation step writes a fixed-size
+   event into an in-memory ring buffer holding the latest events. When
+   disabled, a step only tests jk_vm->trace.enabled. */
+
+#define JK_TRACE_NO_WORD ((word_t)-1)
+
+typedef struct jk_trace_event {
+    unsigned long step;          /* number of the step since tracing began */
+    word_t word;                 /* word called, or JK_TRACE_NO_WORD */
+    unsigned int depth;          /* data stack depth before the step */
+    unsigned long cells;         /* cells allocated so far */
+} jk_trace_event_t;
+
+/* Trace buffer of a VM, see trace.c */
+typedef struct jk_trace {
+    int enabled;
+    jk_trace_event_t *ring;
+    size_t mask;
+    unsigned long step;
+    int dump_on_error;
+} jk_trace_t;
+
+#if defined(__GNUC__)
+#define JK_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define JK_UNLIKELY(x) (x)
+#endif
+
+#define JK_TRACE(f, w)                                                         \
+    do {                                                                       \
+        if (JK_UNLIKELY(jk_vm->trace.enabled))                                 \
+            jk_trace_record((f), (w));                                         \
+    } while (0)
+
+/* capacity is rounded up to a power of two. With dump_on_error, the buffer
+   is dumped when a fiber stops on an error. */
+void jk_trace_enable(size_t capacity, int dump_on_error);
+void jk_trace_disable();
+void jk_trace_record(jk_fiber_t *f, word_t w);
+/* Copies up to max of the latest events, oldest first, and returns their
+   number */
+size_t jk_trace_snapshot(jk_trace_event_t *out, size_t max);
+void jk_trace_dump();
+void jk_trace_error();
+
+#endif
@@ -2,6 +2,7 @@
 #define TYPES_H
 
 #include "word_table.h" /* for word_t type declaration */
+#include <limits.h>
 
 typedef enum jk_type {
     JK_UNDEFINED = -3,
@@ -15,59 +16,152 @@ typedef enum jk_type {
     JK_BUILTIN,
     JK_FIBER,
     JK_ERROR,
+    JK_CHANNEL,
+    JK_BIGINT, /* integer out of the range of JK_INT_CTYPE, see bigint.h */
+    JK_VECTOR, /* packed 64 bit integers, see vector.h */
 } jk_type;
 
 struct jk_fiber;
+struct jk_chan;
+struct jk_bigint;
+struct jk_string;
+struct jk_vector;
 
+/* An object is either an index into heap[] (non-negative values) or an
+   immediate value encoded in the negative half:
+     10xx xxxx ...  small integers (30 bit, two's complement)
+     110x xxxx ...  words (29 bit word_t)
+     111x xxxx ...  booleans, and the special values JK_NIL, JK_EOF and
+                    JK_UNDEFINED at the very top of the range
+   Immediates do not use any heap cell. */
 typedef int jk_object_t;
 
+#define JK_IMM_INT_TAG 0x80000000u
+#define JK_IMM_WORD_TAG 0xc0000000u
+#define JK_IMM_MISC_TAG 0xe0000000u
+#define JK_IMM_INT_MIN (-(1L << 29))
+#define JK_IMM_INT_MAX ((1L << 29) - 1)
+#define JK_IMM_WORD_MAX 0x1fffffffu
+
+#define JK_IS_IMMEDIATE(j) ((j) < 0)
+#define JK_IS_IMM_INT(j) (((unsigned)(j)&0xc0000000u) == JK_IMM_INT_TAG)
+#define JK_IS_IMM_WORD(j) (((unsigned)(j)&0xe0000000u) == JK_IMM_WORD_TAG)
+#define JK_IMM_INT(i) ((jk_object_t)(JK_IMM_INT_TAG | ((unsigned)(i)&0x3fffffffu)))
+#define JK_IMM_INT_VALUE(j)                                                    \
+    ((JK_INT_CTYPE)((unsigned)(j)&0x3fffffffu) -                               \
+     (((unsigned)(j)&0x20000000u) ? (1L << 30) : 0))
+#define JK_IMM_WORD(w) ((jk_object_t)(JK_IMM_WORD_TAG | (w)))
+#define JK_FALSE ((jk_object_t)JK_IMM_MISC_TAG)
+#define JK_TRUE ((jk_object_t)(JK_IMM_MISC_TAG | 1))
+
 #define JK_INT_CTYPE long
+#define JK_INT_CTYPE_MIN LONG_MIN
+#define JK_INT_CTYPE_MAX LONG_MAX
 #define JK_INT_CTYPE_FORMAT "%ld"
-#define JK_INT_CTYPE_FROM_STRING atol
 
 struct jk_object {
     jk_type type;
+    int code; /* compiled quotation (see compile.c), or inline string */
     union value {
         JK_INT_CTYPE as_int;
         int as_bool;
-        const char *as_string;
+        struct jk_string *as_string;
+        char as_chars[8]; /* short string, see str.h */
         word_t as_word;
         void (*as_builtin)(struct jk_fiber *);
         struct jk_fiber *as_fiber;
         jk_object_t as_error;
+        struct jk_chan *as_chan;
+        struct jk_bigint *as_bigint;
+        struct jk_vector *as_vector;
         struct pair {
             int car, cdr;
         } as_pair;
     } value;
 };
 
+/* Data stack: a growable array, top of the stack last */
+typedef struct jk_stack {
+    jk_object_t *items;
+    size_t size, capacity;
+} jk_stack_t;
+
+/* Call frame: position of the next instruction in the code of a shared
+   quotation */
+typedef struct jk_frame {
+    struct jk_code *code;
+    size_t ip;
+    word_t word; /* word called, or JK_TRACE_NO_WORD (see profile.h) */
+} jk_frame_t;
+
+typedef struct jk_frames {
+    jk_frame_t *items;
+    size_t size, capacity;
+} jk_frames_t;
+
+typedef enum jk_fiber_state {
+    JK_FIBER_IDLE,    /* not in the scheduler */
+    JK_FIBER_READY,   /* in the run queue */
+    JK_FIBER_RUNNING, /* taken out of the run queue for a time slice */
+    JK_FIBER_BLOCKED, /* in a wait queue */
+} jk_fiber_state;
+
+/* FIFO of fibers linked through sched_next */
+typedef struct jk_fiber_queue {
+    struct jk_fiber *head, *tail;
+} jk_fiber_queue_t;
+
 typedef struct jk_fiber {
-    jk_object_t stack, queue, env_stack;
+    jk_stack_t stack;
+    jk_frames_t frames; /* return stack, innermost frame last */
+    jk_object_t queue, queue_tail; /* input, run once the frames are done */
+    struct jk_env *env;
+    jk_object_t self; /* JK_FIBER cell of the fiber, or JK_NIL */
+    /* scheduler bookkeeping, see scheduler.c */
+    jk_fiber_state state;
+    int suspend; /* set by a builtin to end the current time slice */
+    struct jk_fiber *sched_next; /* in the run queue or a wait queue */
+    jk_fiber_queue_t *waiting;   /* the wait queue of a blocked fiber */
+    jk_fiber_queue_t joiners;    /* fibers blocked until this one is done */
+    struct jk_fiber *joining;    /* the fiber this one is joining */
+    /* garbage collector bookkeeping */
+    struct jk_fiber *gc_next, *gc_prev;
+    unsigned int gc_epoch;
+    int boxed; /* owned by its self cell instead of the host */
 } jk_fiber_t;
 
 jk_fiber_t *jk_fiber_new();
+/* New fiber owned by the heap, whose environment is a scope inheriting
+   the one of parent */
+jk_fiber_t *jk_fiber_spawn(jk_fiber_t *parent);
 void jk_fiber_free(jk_fiber_t *f);
 
-extern struct jk_object *heap;
+/* Cell j of the heap of the current VM (see vm.h) */
+#define JK_CELL(j) (jk_vm->heap.cells[(j)])
 
 jk_type jk_get_type(jk_object_t);
 void jk_set_type(jk_object_t, jk_type);
 
-#define AS_INT(j) (heap[(j)].value.as_int)
-#define AS_BOOL(j) (heap[(j)].value.as_bool)
-#define AS_STRING(j) (heap[(j)].value.as_string)
-#define AS_WORD(j) (heap[(j)].value.as_word)
-#define AS_QUOTATION(j) (heap[(j)].value.as_pair)
-#define CAR(j) (heap[(j)].value.as_pair.car)
-#define CDR(j) (heap[(j)].value.as_pair.cdr)
+/* AS_INT, AS_BOOL and AS_WORD decode immediates and are not lvalues */
+#define AS_INT(j)                                                              \
+    (JK_IS_IMM_INT(j) ? JK_IMM_INT_VALUE(j) : JK_CELL(j).value.as_int)
+#define AS_BOOL(j) ((int)((unsigned)(j)&1))
+#define AS_WORD(j) ((word_t)((unsigned)(j)&JK_IMM_WORD_MAX))
+#define AS_QUOTATION(j) (JK_CELL(j).value.as_pair)
+#define CAR(j) (JK_CELL(j).value.as_pair.car)
+#define CDR(j) (JK_CELL(j).value.as_pair.cdr)
 #define CAAR(j) (CAR(CAR(j)))
 #define CDAR(j) (CDR(CAR(j)))
-#define AS_BUILTIN(j) (heap[(j)].value.as_builtin)
-#define AS_FIBER(j) (heap[(j)].value.as_fiber)
-#define AS_ERROR(j) (heap[(j)].value.as_error)
+#define AS_BUILTIN(j) (JK_CELL(j).value.as_builtin)
+#define AS_FIBER(j) (JK_CELL(j).value.as_fiber)
+#define AS_ERROR(j) (JK_CELL(j).value.as_error)
+#define AS_CHAN(j) (JK_CELL(j).value.as_chan)
+#define AS_BIGINT(j) (JK_CELL(j).value.as_bigint)
+#define AS_VECTOR(j) (JK_CELL(j).value.as_vector)
 
 jk_object_t jk_make_int(JK_INT_CTYPE i);
 jk_object_t jk_make_bool(int b);
+/* See str.h */
 jk_object_t jk_make_string(const char *str);
 jk_object_t jk_make_word(word_t w);
 jk_object_t jk_make_word_from_string(const char *w);
@@ -75,6 +169,7 @@ jk_object_t jk_make_pair(jk_object_t car, jk_object_t cdr);
 jk_object_t jk_concat(jk_object_t q1, jk_object_t q2);
 jk_object_t jk_append(jk_object_t q, jk_object_t j);
 jk_object_t jk_make_builtin(void (*f)(struct jk_fiber *));
+/* Returns the self cell of f, creating it on first use */
 jk_object_t jk_make_fiber(jk_fiber_t *f);
 jk_object_t jk_make_error(jk_object_t j);
 
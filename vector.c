@@ -0,0 +1,540 @@
+#include "vector.h"
+#include "bigint.h"
+#include "heap.h"
+#include "misc.h"
+#include "vm.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Each kernel comes in plain C and, on x86, in SSE2 and AVX2 versions that
+   go through the items a register at a time and leave the remainder to
+   the plain C loop. AVX2 is not part of the baseline the build targets:
+   its kernels are compiled for it on their own and only chosen once the
+   processor is known to have it. Items are added and multiplied as
+   unsigned integers, so that wrapping around is defined in C too.
+
+   The sum and the dot product are exact instead: their kernels keep a
+   lane per register slot and report when one overflowed, or when an item
+   is too wide for its products to stay exact, and the items are then
+   gone through again in plain C with checked arithmetic, spilling into a
+   bignum. */
+
+#if !defined(JK_NO_SIMD) && defined(__GNUC__) &&                              \
+    (defined(__x86_64__) || defined(__i386__))
+#define VECTOR_AVX2
+#include <immintrin.h>
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+#if !defined(JK_NO_SIMD) && defined(__SSE2__)
+#define VECTOR_SSE2
+#include <emmintrin.h>
+#endif
+
+/* Header padded so that the items that follow it are aligned */
+#define HEADER_SIZE                                                            \
+    ((sizeof(jk_vector_t) + JK_VECTOR_ALIGN - 1) / JK_VECTOR_ALIGN *           \
+     JK_VECTOR_ALIGN)
+
+jk_vector_t *jk_vector_new(size_t len) {
+    void *block;
+    if (len > (SIZE_MAX - HEADER_SIZE) / sizeof(int64_t) ||
+        posix_memalign(&block, JK_VECTOR_ALIGN,
+                       HEADER_SIZE + sizeof(int64_t) * len) != 0)
+        jiko_panic("jk_vector_new: allocation failed");
+    jk_vector_t *v = (jk_vector_t *)block;
+    v->len = len;
+    v->items = (int64_t *)((char *)block + HEADER_SIZE);
+    return v;
+}
+
+size_t jk_vector_size(const jk_vector_t *v) {
+    return HEADER_SIZE + sizeof(int64_t) * v->len;
+}
+
+char *jk_vector_to_string(const jk_vector_t *v) {
+    /* 20 characters for INT64_MIN, and a separator */
+    char *res = (char *)malloc(21 * v->len + 1), *p = res;
+    if (!res)
+        jiko_panic("jk_vector_to_string: malloc failed");
+    *p = 0;
+    for (size_t i = 0; i < v->len; i++)
+        p += sprintf(p, i ? " %" PRId64 : "%" PRId64, v->items[i]);
+    return res;
+}
+
+jk_vector_t *jk_vector_from_string(const char *str) {
+    size_t len = *str != 0, i;
+    for (const char *s = str; *s; s++)
+        len += *s == ' ';
+    jk_vector_t *v = jk_vector_new(len);
+    for (i = 0; i < len; i++) {
+        char *end;
+        long long item;
+        if (*str != '-' && (*str < '0' || *str > '9'))
+            break;
+        errno = 0;
+        item = strtoll(str, &end, 10);
+        if (errno || end == str || (*end != ' ' && *end != 0))
+            break;
+        v->items[i] = (int64_t)item;
+        str = *end ? end + 1 : end;
+    }
+    if (i < len || *str) {
+        free(v);
+        return NULL;
+    }
+    return v;
+}
+
+/* SIMD kernels **************************************************************/
+
+/* Kernels of one instruction set. Each goes through the first items a
+   whole register at a time and returns the number of items it did; the
+   reductions leave their partial result in *acc. sum and dot leave theirs
+   in up to VECTOR_LANES lanes, and return VECTOR_INEXACT instead when
+   those are not exact. A NULL kernel does no item. */
+
+#define VECTOR_LANES 4
+#define VECTOR_INEXACT ((size_t)-1)
+
+typedef struct vector_kernels {
+    size_t (*add)(int64_t *, const int64_t *, const int64_t *, size_t);
+    size_t (*sub)(int64_t *, const int64_t *, const int64_t *, size_t);
+    size_t (*mul)(int64_t *, const int64_t *, const int64_t *, size_t);
+    size_t (*scale)(int64_t *, const int64_t *, int64_t, size_t);
+    size_t (*sum)(const int64_t *, size_t, int64_t *lanes);
+    size_t (*dot)(const int64_t *, const int64_t *, size_t, int64_t *lanes);
+    size_t (*min)(const int64_t *, size_t, int64_t *acc);
+    size_t (*max)(const int64_t *, size_t, int64_t *acc);
+} vector_kernels_t;
+
+#ifdef VECTOR_SSE2
+
+#define LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define STORE(p, x) _mm_storeu_si128((__m128i *)(p), (x))
+
+/* Low 64 bits of the products, from three 32 by 32 bit ones */
+static __m128i mullo_sse2(__m128i a, __m128i b) {
+    __m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b),
+                                  _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+    return _mm_add_epi64(_mm_mul_epu32(a, b), _mm_slli_epi64(cross, 32));
+}
+
+/* Sign bit set in the lanes where r = s + x overflowed */
+static __m128i overflow_sse2(__m128i s, __m128i x, __m128i r) {
+    return _mm_and_si128(_mm_xor_si128(s, r), _mm_xor_si128(x, r));
+}
+
+/* Nonzero in the lanes out of [-2^31, 2^31), where products may not fit
+   in 63 bits */
+static __m128i wide_sse2(__m128i x) {
+    return _mm_srli_epi64(_mm_add_epi64(x, _mm_set1_epi64x(INT64_C(1) << 31)),
+                          32);
+}
+
+static size_t add_sse2(int64_t *r, const int64_t *a, const int64_t *b,
+                       size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        STORE(r + i, _mm_add_epi64(LOAD(a + i), LOAD(b + i)));
+    return i;
+}
+
+static size_t sub_sse2(int64_t *r, const int64_t *a, const int64_t *b,
+                       size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        STORE(r + i, _mm_sub_epi64(LOAD(a + i), LOAD(b + i)));
+    return i;
+}
+
+static size_t mul_sse2(int64_t *r, const int64_t *a, const int64_t *b,
+                       size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        STORE(r + i, mullo_sse2(LOAD(a + i), LOAD(b + i)));
+    return i;
+}
+
+static size_t scale_sse2(int64_t *r, const int64_t *a, int64_t k, size_t n) {
+    __m128i kk = _mm_set1_epi64x(k);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        STORE(r + i, mullo_sse2(LOAD(a + i), kk));
+    return i;
+}
+
+static size_t sum_sse2(const int64_t *a, size_t n, int64_t *lanes) {
+    __m128i s = _mm_setzero_si128(), ovf = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i x = LOAD(a + i), r = _mm_add_epi64(s, x);
+        ovf = _mm_or_si128(ovf, overflow_sse2(s, x, r));
+        s = r;
+    }
+    STORE(lanes, s);
+    return _mm_movemask_pd(_mm_castsi128_pd(ovf)) ? VECTOR_INEXACT : i;
+}
+
+static size_t dot_sse2(const int64_t *a, const int64_t *b, size_t n,
+                       int64_t *lanes) {
+    __m128i s = _mm_setzero_si128(), ovf = _mm_setzero_si128();
+    __m128i wide = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i x = LOAD(a + i), y = LOAD(b + i);
+        __m128i p = mullo_sse2(x, y), r = _mm_add_epi64(s, p);
+        wide = _mm_or_si128(wide, _mm_or_si128(wide_sse2(x), wide_sse2(y)));
+        ovf = _mm_or_si128(ovf, overflow_sse2(s, p, r));
+        s = r;
+    }
+    STORE(lanes, s);
+    if (_mm_movemask_pd(_mm_castsi128_pd(ovf)) ||
+        _mm_movemask_epi8(_mm_cmpeq_epi32(wide, _mm_setzero_si128())) !=
+            0xffff)
+        return VECTOR_INEXACT;
+    return i;
+}
+
+/* SSE2 has no 64 bit comparison: min and max stay in plain C */
+static const vector_kernels_t kernels_sse2 = {
+    add_sse2, sub_sse2, mul_sse2, scale_sse2, sum_sse2, dot_sse2, NULL, NULL,
+};
+
+#undef LOAD
+#undef STORE
+
+#endif /* VECTOR_SSE2 */
+
+#ifdef VECTOR_AVX2
+
+#define LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define STORE(p, x) _mm256_storeu_si256((__m256i *)(p), (x))
+
+AVX2 static __m256i mullo_avx2(__m256i a, __m256i b) {
+    __m256i cross =
+        _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                         _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(_mm256_mul_epu32(a, b),
+                            _mm256_slli_epi64(cross, 32));
+}
+
+AVX2 static __m256i overflow_avx2(__m256i s, __m256i x, __m256i r) {
+    return _mm256_and_si256(_mm256_xor_si256(s, r), _mm256_xor_si256(x, r));
+}
+
+AVX2 static __m256i wide_avx2(__m256i x) {
+    return _mm256_srli_epi64(
+        _mm256_add_epi64(x, _mm256_set1_epi64x(INT64_C(1) << 31)), 32);
+}
+
+AVX2 static size_t add_avx2(int64_t *r, const int64_t *a, const int64_t *b,
+                            size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        STORE(r + i, _mm256_add_epi64(LOAD(a + i), LOAD(b + i)));
+    return i;
+}
+
+AVX2 static size_t sub_avx2(int64_t *r, const int64_t *a, const int64_t *b,
+                            size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        STORE(r + i, _mm256_sub_epi64(LOAD(a + i), LOAD(b + i)));
+    return i;
+}
+
+AVX2 static size_t mul_avx2(int64_t *r, const int64_t *a, const int64_t *b,
+                            size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        STORE(r + i, mullo_avx2(LOAD(a + i), LOAD(b + i)));
+    return i;
+}
+
+AVX2 static size_t scale_avx2(int64_t *r, const int64_t *a, int64_t k,
+                              size_t n) {
+    __m256i kk = _mm256_set1_epi64x(k);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        STORE(r + i, mullo_avx2(LOAD(a + i), kk));
+    return i;
+}
+
+AVX2 static size_t sum_avx2(const int64_t *a, size_t n, int64_t *lanes) {
+    __m256i s = _mm256_setzero_si256(), ovf = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = LOAD(a + i), r = _mm256_add_epi64(s, x);
+        ovf = _mm256_or_si256(ovf, overflow_avx2(s, x, r));
+        s = r;
+    }
+    STORE(lanes, s);
+    return _mm256_movemask_pd(_mm256_castsi256_pd(ovf)) ? VECTOR_INEXACT : i;
+}
+
+AVX2 static size_t dot_avx2(const int64_t *a, const int64_t *b, size_t n,
+                            int64_t *lanes) {
+    __m256i s = _mm256_setzero_si256(), ovf = _mm256_setzero_si256();
+    __m256i wide = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = LOAD(a + i), y = LOAD(b + i);
+        __m256i p = mullo_avx2(x, y), r = _mm256_add_epi64(s, p);
+        wide = _mm256_or_si256(wide,
+                               _mm256_or_si256(wide_avx2(x), wide_avx2(y)));
+        ovf = _mm256_or_si256(ovf, overflow_avx2(s, p, r));
+        s = r;
+    }
+    STORE(lanes, s);
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(ovf)) ||
+        !_mm256_testz_si256(wide, wide))
+        return VECTOR_INEXACT;
+    return i;
+}
+
+/* Lanes of m replaced by the ones of x where gt(m, x) holds */
+#define SELECT(m, x, gt) _mm256_blendv_epi8((m), (x), (gt))
+
+AVX2 static size_t min_avx2(const int64_t *a, size_t n, int64_t *acc) {
+    int64_t lanes[4];
+    size_t i = 4;
+    if (n < 4)
+        return 0;
+    __m256i m = LOAD(a);
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = LOAD(a + i);
+        m = SELECT(m, x, _mm256_cmpgt_epi64(m, x));
+    }
+    STORE(lanes, m);
+    *acc = lanes[0];
+    for (int k = 1; k < 4; k++)
+        if (lanes[k] < *acc)
+            *acc = lanes[k];
+    return i;
+}
+
+AVX2 static size_t max_avx2(const int64_t *a, size_t n, int64_t *acc) {
+    int64_t lanes[4];
+    size_t i = 4;
+    if (n < 4)
+        return 0;
+    __m256i m = LOAD(a);
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = LOAD(a + i);
+        m = SELECT(m, x, _mm256_cmpgt_epi64(x, m));
+    }
+    STORE(lanes, m);
+    *acc = lanes[0];
+    for (int k = 1; k < 4; k++)
+        if (lanes[k] > *acc)
+            *acc = lanes[k];
+    return i;
+}
+
+static const vector_kernels_t kernels_avx2 = {
+    add_avx2, sub_avx2, mul_avx2, scale_avx2,
+    sum_avx2, dot_avx2, min_avx2, max_avx2,
+};
+
+#undef SELECT
+#undef LOAD
+#undef STORE
+
+#endif /* VECTOR_AVX2 */
+
+#ifndef VECTOR_SSE2
+static const vector_kernels_t kernels_none;
+#endif
+
+/* Widest kernels the processor runs */
+static const vector_kernels_t *vector_kernels() {
+#ifdef VECTOR_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return &kernels_avx2;
+#endif
+#ifdef VECTOR_SSE2
+    return &kernels_sse2;
+#else
+    return &kernels_none;
+#endif
+}
+
+/* Kernels *******************************************************************/
+
+void jk_vector_add(int64_t *r, const int64_t *a, const int64_t *b, size_t n) {
+    const vector_kernels_t *k = vector_kernels();
+    for (size_t i = k->add ? k->add(r, a, b, n) : 0; i < n; i++)
+        r[i] = (int64_t)((uint64_t)a[i] + (uint64_t)b[i]);
+}
+
+void jk_vector_sub(int64_t *r, const int64_t *a, const int64_t *b, size_t n) {
+    const vector_kernels_t *k = vector_kernels();
+    for (size_t i = k->sub ? k->sub(r, a, b, n) : 0; i < n; i++)
+        r[i] = (int64_t)((uint64_t)a[i] - (uint64_t)b[i]);
+}
+
+void jk_vector_mul(int64_t *r, const int64_t *a, const int64_t *b, size_t n) {
+    const vector_kernels_t *k = vector_kernels();
+    for (size_t i = k->mul ? k->mul(r, a, b, n) : 0; i < n; i++)
+        r[i] = (int64_t)((uint64_t)a[i] * (uint64_t)b[i]);
+}
+
+void jk_vector_scale(int64_t *r, const int64_t *a, int64_t x, size_t n) {
+    const vector_kernels_t *k = vector_kernels();
+    for (size_t i = k->scale ? k->scale(r, a, x, n) : 0; i < n; i++)
+        r[i] = (int64_t)((uint64_t)a[i] * (uint64_t)x);
+}
+
+int64_t jk_vector_min(const int64_t *a, size_t n) {
+    const vector_kernels_t *k = vector_kernels();
+    int64_t acc = a[0];
+    for (size_t i = k->min ? k->min(a, n, &acc) : 0; i < n; i++)
+        if (a[i] < acc)
+            acc = a[i];
+    return acc;
+}
+
+int64_t jk_vector_max(const int64_t *a, size_t n) {
+    const vector_kernels_t *k = vector_kernels();
+    int64_t acc = a[0];
+    for (size_t i = k->max ? k->max(a, n, &acc) : 0; i < n; i++)
+        if (a[i] > acc)
+            acc = a[i];
+    return acc;
+}
+
+/* Objects *******************************************************************/
+
+jk_object_t jk_make_vector(jk_vector_t *v) {
+    jk_object_t res = jk_object_alloc();
+    jk_set_type(res, JK_VECTOR);
+    AS_VECTOR(res) = v;
+    jk_vm->heap.vector_bytes += jk_vector_size(v);
+    return res;
+}
+
+static jk_bigint_t *bigint_from_int64(int64_t i) {
+    char digits[24];
+    if (i >= JK_INT_CTYPE_MIN && i <= JK_INT_CTYPE_MAX)
+        return jk_bigint_from_int((JK_INT_CTYPE)i);
+    sprintf(digits, "%" PRId64, i);
+    return jk_bigint_from_chars(digits, strlen(digits));
+}
+
+jk_object_t jk_make_int64(int64_t i) {
+    if (i >= JK_INT_CTYPE_MIN && i <= JK_INT_CTYPE_MAX)
+        return jk_make_int((JK_INT_CTYPE)i);
+    return jk_make_bigint(bigint_from_int64(i));
+}
+
+#if defined(__GNUC__)
+#define ADD_OVERFLOW(a, b, r) __builtin_add_overflow((a), (b), (r))
+#define MUL_OVERFLOW(a, b, r) __builtin_mul_overflow((a), (b), (r))
+#else
+static int add_overflow64(int64_t a, int64_t b, int64_t *r) {
+    if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b))
+        return 1;
+    *r = a + b;
+    return 0;
+}
+
+static int mul_overflow64(int64_t a, int64_t b, int64_t *r) {
+    if (a && b &&
+        ((a == -1 && b == INT64_MIN) || (b == -1 && a == INT64_MIN) ||
+         (a != -1 && b != -1 && (int64_t)((uint64_t)a * (uint64_t)b) / b != a)))
+        return 1;
+    *r = (int64_t)((uint64_t)a * (uint64_t)b);
+    return 0;
+}
+#define ADD_OVERFLOW(a, b, r) add_overflow64((a), (b), (r))
+#define MUL_OVERFLOW(a, b, r) mul_overflow64((a), (b), (r))
+#endif
+
+/* Exact sum: small while it fits, the excess spilled into big */
+typedef struct vector_acc {
+    int64_t small;
+    jk_bigint_t *big; /* NULL for 0 */
+} vector_acc_t;
+
+/* Adds x to big, and frees x */
+static void vector_acc_spill(vector_acc_t *acc, jk_bigint_t *x) {
+    jk_bigint_t *sum;
+    if (!acc->big) {
+        acc->big = x;
+        return;
+    }
+    sum = jk_bigint_add(acc->big, x);
+    free(acc->big);
+    free(x);
+    acc->big = sum;
+}
+
+static void vector_acc_add(vector_acc_t *acc, int64_t x) {
+    int64_t sum;
+    if (ADD_OVERFLOW(acc->small, x, &sum)) {
+        vector_acc_spill(acc, bigint_from_int64(acc->small));
+        sum = x;
+    }
+    acc->small = sum;
+}
+
+static jk_object_t vector_acc_result(vector_acc_t *acc) {
+    if (!acc->big)
+        return jk_make_int64(acc->small);
+    vector_acc_spill(acc, bigint_from_int64(acc->small));
+    return jk_make_bigint(acc->big);
+}
+
+jk_object_t jk_vector_sum(const int64_t *a, size_t n) {
+    const vector_kernels_t *k = vector_kernels();
+    vector_acc_t acc = {0, NULL};
+    int64_t lanes[VECTOR_LANES] = {0};
+    size_t i = k->sum ? k->sum(a, n, lanes) : 0;
+    if (i == VECTOR_INEXACT)
+        i = 0;
+    else
+        for (int l = 0; l < VECTOR_LANES; l++)
+            vector_acc_add(&acc, lanes[l]);
+    for (; i < n; i++)
+        vector_acc_add(&acc, a[i]);
+    return vector_acc_result(&acc);
+}
+
+jk_object_t jk_vector_dot(const int64_t *a, const int64_t *b, size_t n) {
+    const vector_kernels_t *k = vector_kernels();
+    vector_acc_t acc = {0, NULL};
+    int64_t lanes[VECTOR_LANES] = {0};
+    size_t i = k->dot ? k->dot(a, b, n, lanes) : 0;
+    if (i == VECTOR_INEXACT)
+        i = 0;
+    else
+        for (int l = 0; l < VECTOR_LANES; l++)
+            vector_acc_add(&acc, lanes[l]);
+    for (; i < n; i++) {
+        int64_t p;
+        if (!MUL_OVERFLOW(a[i], b[i], &p)) {
+            vector_acc_add(&acc, p);
+        } else {
+            jk_bigint_t *x = bigint_from_int64(a[i]);
+            jk_bigint_t *y = bigint_from_int64(b[i]);
+            vector_acc_spill(&acc, jk_bigint_mul(x, y));
+            free(x);
+            free(y);
+        }
+    }
+    return vector_acc_result(&acc);
+}
+
+#undef ADD_OVERFLOW
+#undef MUL_OVERFLOW
+#undef VECTOR_LANES
+#undef VECTOR_INEXACT
+#undef VECTOR_AVX2
+#undef VECTOR_SSE2
+#undef AVX2
+#undef HEADER_SIZE
@@ -0,0 +1,51 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+
+#include "types.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Packed vectors of 64-bit integers, held by JK_VECTOR cells. Their items
+   are contiguous and aligned for the widest kernel, instead of a cell per
+   number linked through the pairs of a quotation. Arithmetic item by item
+   wraps around modulo 2^64, like the hardware does: unlike the one of
+   integers, it is never promoted to bignums. The sum and the dot product
+   of the items are exact. */
+
+typedef struct jk_vector {
+    size_t len;
+    int64_t *items; /* in the same block, JK_VECTOR_ALIGN aligned */
+} jk_vector_t;
+
+#define JK_VECTOR_ALIGN 32
+
+/* len items left uninitialized, released with free */
+jk_vector_t *jk_vector_new(size_t len);
+/* Bytes held by v, header included */
+size_t jk_vector_size(const jk_vector_t *v);
+/* Items in decimal, separated by spaces */
+char *jk_vector_to_string(const jk_vector_t *v);
+/* Reads the output of jk_vector_to_string, NULL if str is not one */
+jk_vector_t *jk_vector_from_string(const char *str);
+
+/* Kernels on n items. They use AVX2 when the processor has it, else SSE2
+   where available, and plain C otherwise or when built with JK_NO_SIMD.
+   The result r may be one of the operands. */
+void jk_vector_add(int64_t *r, const int64_t *a, const int64_t *b, size_t n);
+void jk_vector_sub(int64_t *r, const int64_t *a, const int64_t *b, size_t n);
+void jk_vector_mul(int64_t *r, const int64_t *a, const int64_t *b, size_t n);
+void jk_vector_scale(int64_t *r, const int64_t *a, int64_t k, size_t n);
+/* n is not 0 */
+int64_t jk_vector_min(const int64_t *a, size_t n);
+int64_t jk_vector_max(const int64_t *a, size_t n);
+
+/* Takes v and returns it as a JK_VECTOR object */
+jk_object_t jk_make_vector(jk_vector_t *v);
+/* Integer object of i, a bignum if it does not fit in JK_INT_CTYPE */
+jk_object_t jk_make_int64(int64_t i);
+/* Exact sum of the items and of their products, as integer objects like
+   jk_make_int64 */
+jk_object_t jk_vector_sum(const int64_t *a, size_t n);
+jk_object_t jk_vector_dot(const int64_t *a, const int64_t *b, size_t n);
+
+#endif
@@ -0,0 +1,50 @@
+#include "vm.h"
+#include "env.h"
+#include "heap.h"
+#include "lib.h"
+#include "misc.h"
+#include "profile.h"
+#include "trace.h"
+#include "word_table.h"
+#include <stdlib.h>
+#include <string.h>
+
+JK_THREAD_LOCAL jk_vm_t *jk_vm = NULL;
+
+jk_vm_t *jk_vm_new_empty(size_t heap_cells, size_t words) {
+    jk_vm_t *vm = (jk_vm_t *)calloc(1, sizeof(jk_vm_t));
+    if (!vm)
+        jiko_panic("jk_vm_new: calloc failed");
+    jk_vm_t *prev = jk_vm_enter(vm);
+    heap_init(heap_cells);
+    word_table_init(words);
+    vm->builtins = jk_env_new(NULL);
+    vm->profile.perf_fd = -1;
+    jk_vm_enter(prev);
+    return vm;
+}
+
+jk_vm_t *jk_vm_new(size_t heap_cells, size_t words) {
+    jk_vm_t *vm = jk_vm_new_empty(heap_cells, words);
+    jk_vm_t *prev = jk_vm_enter(vm);
+    register_lib(vm->builtins, stdlib_builtins);
+    jk_vm_enter(prev);
+    return vm;
+}
+
+void jk_vm_free(jk_vm_t *vm) {
+    jk_vm_t *prev = jk_vm_enter(vm);
+    jk_trace_disable();
+    jk_profile_disable();
+    heap_free();
+    jk_env_release(vm->builtins);
+    word_table_free();
+    free(vm);
+    jk_vm_enter(prev == vm ? NULL : prev);
+}
+
+jk_vm_t *jk_vm_enter(jk_vm_t *vm) {
+    jk_vm_t *prev = jk_vm;
+    jk_vm = vm;
+    return prev;
+}
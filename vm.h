@@ -0,0 +1,54 @@
+#ifndef VM_H
+#define VM_H
+
+#include "compile.h"
+#include "heap.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "types.h"
+#include "word_table.h"
+#include <stddef.h>
+
+/* Interpreter context. Everything an interpreter allocates belongs to one
+   VM: its heap, symbol table, compiled code, scheduler, trace buffer,
+   profile and the scope of builtins shared by its host fibers. The functions of the
+   library work on the VM current on the calling thread, so independent
+   interpreters can run on separate threads as long as objects and fibers
+   do not cross from one VM to another. */
+
+#if defined(JK_NO_THREAD_LOCAL)
+#define JK_THREAD_LOCAL
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define JK_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define JK_THREAD_LOCAL __thread
+#else
+#define JK_THREAD_LOCAL
+#endif
+
+typedef struct jk_vm {
+    jk_heap_t heap;
+    word_table_t words;
+    jk_code_table_t codes;
+    jk_sched_t sched;
+    jk_trace_t trace;
+    jk_profile_t profile;
+    unsigned int env_shape; /* see env.h */
+    struct jk_env *builtins; /* parent scope of the host fibers */
+} jk_vm_t;
+
+/* Current VM of the calling thread */
+extern JK_THREAD_LOCAL jk_vm_t *jk_vm;
+
+/* Creates a VM of heap_cells cells and words initial words, with the
+   standard library registered. The current VM is left unchanged. */
+jk_vm_t *jk_vm_new(size_t heap_cells, size_t words);
+/* Same, without any builtin nor word (see image.h) */
+jk_vm_t *jk_vm_new_empty(size_t heap_cells, size_t words);
+/* Frees the VM and every fiber in it */
+void jk_vm_free(jk_vm_t *vm);
+/* Makes vm current on the calling thread and returns the previous one */
+jk_vm_t *jk_vm_enter(jk_vm_t *vm);
+
+#endif
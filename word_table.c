@@ -1,60 +1,224 @@
 #include "word_table.h"
 #include "misc.h"
+#include "vm.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static const char **word_table = NULL;
-static size_t table_size = 0;
-static size_t counter = 0;
+/* Words are numbered in creation order. Their strings live in an arena, and
+   a hash index (open addressing, 1 + word in each slot, 0 when empty) maps
+   strings to words.
+
+   Readers never lock: the index, the record array and the counter are
+   published with release stores after the data they point to is written,
+   and tables replaced by a resize stay allocated until word_table_free,
+   since a reader may still be probing them. Writers serialize on a spin
+   lock, which is enough as words are only created while parsing. */
+
+#if defined(__GNUC__)
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define LOCK(t) while (__atomic_test_and_set(&(t)->lock, __ATOMIC_ACQUIRE))
+#define UNLOCK(t) __atomic_clear(&(t)->lock, __ATOMIC_RELEASE)
+#else /* not thread safe */
+#define LOAD(p) (*(p))
+#define STORE(p, v) (*(p) = (v))
+#define LOCK(t)
+#define UNLOCK(t)
+#endif
+
+typedef struct word_record {
+    const char *str;
+    size_t len;
+    unsigned int hash;
+} word_record_t;
+
+typedef struct word_index {
+    size_t mask;
+    unsigned int slots[];
+} word_index_t;
+
+typedef struct word_arena {
+    struct word_arena *next;
+    size_t used, size;
+    char data[];
+} word_arena_t;
+
+/* Blocks replaced by a resize, freed by word_table_free */
+typedef struct retired {
+    struct retired *next;
+    void *block;
+} retired_t;
+
+#define ARENA_CHUNK_SIZE 65536
+
+static unsigned int hash_chars(const char *str, size_t len) {
+    unsigned int h = 2166136261u; /* FNV-1a */
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)str[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static word_index_t *word_index_new(size_t size) {
+    word_index_t *res = (word_index_t *)calloc(
+        1, sizeof(word_index_t) + sizeof(unsigned int) * size);
+    if (!res)
+        jiko_panic("word_table: calloc failed");
+    res->mask = size - 1;
+    return res;
+}
+
+static void word_retire(word_table_t *t, void *block) {
+    retired_t *r = (retired_t *)malloc(sizeof(retired_t));
+    if (!r)
+        jiko_panic("word_table: malloc failed");
+    r->block = block;
+    r->next = t->retired;
+    t->retired = r;
+}
 
 void word_table_init(size_t s) {
-    table_size = s;
-    word_table = (const char**)malloc(sizeof(const char *) * s);
-    assert(word_table && "init_word_table: malloc failed");
-    for (size_t i = 0; i < s; i++)
-        word_table[i] = NULL;
+    word_table_t *t = &jk_vm->words;
+    size_t index_size = 16;
+    while (index_size < s * 2)
+        index_size *= 2;
+    t->size = s;
+    t->count = 0;
+    t->records = (word_record_t *)malloc(sizeof(word_record_t) * s);
+    assert(t->records && "init_word_table: malloc failed");
+    t->index = word_index_new(index_size);
+    t->arena = NULL;
+    t->retired = NULL;
+    t->lock = 0;
 }
 
 void word_table_free() {
-    for (size_t i = 0; i < counter; i++) {
-        free((void *)word_table[i]);
+    word_table_t *t = &jk_vm->words;
+    while (t->arena) {
+        word_arena_t *next = t->arena->next;
+        free(t->arena);
+        t->arena = next;
     }
-    free(word_table);
+    while (t->retired) {
+        retired_t *next = t->retired->next;
+        free(t->retired->block);
+        free(t->retired);
+        t->retired = next;
+    }
+    free(t->records);
+    free(t->index);
+    t->records = NULL;
+    t->index = NULL;
+    t->size = t->count = 0;
 }
 
-static void enlarge_table() {
-    size_t new_size = table_size * 2;
-    word_table = (const char**)realloc(word_table, sizeof(const char *) * new_size);
-    if (!word_table)
-        jiko_panic("enlarge_table: realloc failed");
-    table_size = new_size;
+static const char *arena_strndup(word_table_t *t, const char *str,
+                                 size_t len) {
+    word_arena_t *arena = t->arena;
+    if (!arena || arena->size - arena->used < len + 1) {
+        size_t size = len + 1 > ARENA_CHUNK_SIZE ? len + 1 : ARENA_CHUNK_SIZE;
+        arena = (word_arena_t *)malloc(sizeof(word_arena_t) + size);
+        if (!arena)
+            jiko_panic("word_table: malloc failed");
+        arena->next = t->arena;
+        arena->used = 0;
+        arena->size = size;
+        t->arena = arena;
+    }
+    char *res = &arena->data[arena->used];
+    memcpy(res, str, len);
+    res[len] = 0;
+    arena->used += len + 1;
+    return res;
 }
 
-static word_t new_word(const char *str) {
-    if (counter >= table_size)
-        enlarge_table();
-    word_table[counter] = strdup(str);
-    word_t res = counter;
-    counter++;
-    return res;
+/* Returns the slot of str in index, or the empty slot where it would go.
+   The records are loaded after each slot: a slot is published after the
+   record array holding its word, which a resize may have just replaced. */
+static unsigned int *word_probe(word_index_t *index, word_record_t **records,
+                                const char *str, size_t len,
+                                unsigned int hash) {
+    for (size_t i = hash & index->mask;; i = (i + 1) & index->mask) {
+        unsigned int *slot = &index->slots[i];
+        unsigned int w = LOAD(slot);
+        if (w == 0)
+            return slot;
+        word_record_t *r = &LOAD(records)[w - 1];
+        if (r->hash == hash && r->len == len && !memcmp(r->str, str, len))
+            return slot;
+    }
 }
 
-word_t word_from_string(const char *str) {
-    for (size_t i = 0; i < counter; i++) {
-        assert(word_table[i] &&
-               "word_table[i] shouldn't be null when i < counter");
-        if (!strcmp(str, word_table[i]))
-            return i;
+static void enlarge_table(word_table_t *t) {
+    size_t new_size = t->size * 2;
+    word_record_t *new_records =
+        (word_record_t *)malloc(sizeof(word_record_t) * new_size);
+    if (!new_records)
+        jiko_panic("enlarge_table: malloc failed");
+    memcpy(new_records, t->records, sizeof(word_record_t) * t->count);
+    word_retire(t, t->records);
+    STORE(&t->records, new_records);
+    t->size = new_size;
+}
+
+static void enlarge_index(word_table_t *t) {
+    word_index_t *new_index = word_index_new((t->index->mask + 1) * 2);
+    for (size_t i = 0; i < t->count; i++) {
+        word_record_t *r = &t->records[i];
+        *word_probe(new_index, &t->records, r->str, r->len, r->hash) =
+            (unsigned int)i + 1;
     }
+    word_retire(t, t->index);
+    STORE(&t->index, new_index);
+}
+
+word_t word_from_chars(const char *str, size_t len) {
+    word_table_t *t = &jk_vm->words;
+    unsigned int hash = hash_chars(str, len);
+    word_index_t *index = LOAD(&t->index);
+    unsigned int w = LOAD(word_probe(index, &t->records, str, len, hash));
+    if (w)
+        return w - 1;
+
     /* not found: we allocate a new word */
-    return new_word(str);
+    LOCK(t);
+    unsigned int *slot = word_probe(t->index, &t->records, str, len, hash);
+    if (*slot) { /* created by another thread meanwhile */
+        w = *slot;
+        UNLOCK(t);
+        return w - 1;
+    }
+    if (t->count >= t->size)
+        enlarge_table(t);
+    word_record_t *r = &t->records[t->count];
+    r->str = arena_strndup(t, str, len);
+    r->len = len;
+    r->hash = hash;
+    word_t res = t->count;
+    STORE(&t->count, t->count + 1);
+    STORE(slot, (unsigned int)res + 1);
+    if (t->count * 2 > t->index->mask + 1)
+        enlarge_index(t);
+    UNLOCK(t);
+    return res;
+}
+
+word_t word_from_string(const char *str) {
+    return word_from_chars(str, strlen(str));
 }
 
 const char *word_to_string(word_t word) {
-    if (word < counter)
-        return word_table[word];
+    word_table_t *t = &jk_vm->words;
+    if (word < LOAD(&t->count))
+        return LOAD(&t->records)[word].str;
     else
         return NULL;
-}
\ No newline at end of file
+}
+
+#undef LOAD
+#undef STORE
+#undef LOCK
+#undef UNLOCK
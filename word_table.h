@@ -5,9 +5,23 @@
 
 typedef unsigned int word_t;
 
+/* Symbol table of a VM, see word_table.c */
+typedef struct word_table {
+    struct word_record *records; /* indexed by word */
+    size_t size, count;
+    struct word_index *index;
+    struct word_arena *arena;
+    struct retired *retired;
+    char lock;
+} word_table_t;
+
+/* These work on the table of the current VM. Interning is thread safe:
+   lookups of known words and word_to_string are lock-free, only the
+   creation of a new word takes a lock. */
 void word_table_init(size_t s);
 void word_table_free();
 word_t word_from_string(const char *str);
+word_t word_from_chars(const char *str, size_t len);
 const char *word_to_string(word_t);
 
-#endif
\ No newline at end of file
+#endif